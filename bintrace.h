@@ -0,0 +1,39 @@
+/*
+ * bintrace.h - The binary trace format. A binary trace holds the same
+ *     requests as a .rep file, laid out so that mdriver can mmap the
+ *     request array and use it as is, with no parsing. rep2bin writes
+ *     binary traces from .rep files.
+ *
+ * A binary trace is a bintrace_hdr_t followed by num_ops bintrace_op_t
+ * records, all in the byte order of the machine that wrote it.
+ */
+#include <stdint.h>
+
+#define BINTRACE_MAGIC   "MMTRACE"  /* with its NUL, fills magic[] */
+#define BINTRACE_VERSION 3
+
+/* Request types, as in the type field of a bintrace_op_t */
+#define BINTRACE_ALLOC   0
+#define BINTRACE_FREE    1
+#define BINTRACE_REALLOC 2
+#define BINTRACE_MEMALIGN 3  /* an alloc aligned to 1 << arg bytes */
+#define BINTRACE_BATCH_ALLOC 4  /* allocs of ids index to index + arg - 1 */
+#define BINTRACE_BATCH_FREE 5   /* frees of the same ids, of payload size */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t weight;        /* the four numbers of the .rep header */
+    int32_t num_ids;
+    int32_t num_ops;
+    int32_t ignore_ranges;
+    uint32_t pad[9];       /* keeps the records 64-byte aligned */
+} bintrace_hdr_t;
+
+typedef struct {
+    uint16_t type;         /* one of the BINTRACE_ request types */
+    uint16_t arg;          /* log2 of the alignment of a memalign, or the
+                              number of blocks of a batch, else 0 */
+    int32_t index;         /* block id; -1 frees the null pointer */
+    uint64_t size;         /* payload size of an alloc, realloc or batch */
+} bintrace_op_t;
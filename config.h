@@ -71,9 +71,12 @@
 #define ALIGNMENT 16 
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes. The shared library, for real programs,
+ * reserves far more.
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -28,6 +28,7 @@ static int *cache_buf = NULL;
 
 static double *values = NULL;
 static int samplecount = 0;
+static double bestvar = 0;   /* variance of the kbest smallest samples */
 
 /* for debugging only */
 #define KEEP_VALS 0
@@ -90,6 +91,26 @@ static int has_converged()
 	((1 + epsilon)*values[0] >= values[kbest-1]);
 }
 
+/*
+ * kbest_variance - Sample variance of the kbest smallest measurements
+ *     (or of all of them, if there are fewer), whose smallest fcyc
+ *     returns; the larger samples it discards do not count
+ */
+static double kbest_variance()
+{
+    int i, n = (samplecount < kbest) ? samplecount : kbest;
+    double sum = 0, sumsq = 0, var;
+
+    if (n < 2)
+	return 0;
+    for (i = 0; i < n; i++) {
+	sum += values[i];
+	sumsq += values[i] * values[i];
+    }
+    var = (sumsq - sum * sum / n) / (n - 1);
+    return (var > 0) ? var : 0;
+}
+
 /*
  * clear - Code to clear cache
  */
@@ -165,6 +186,7 @@ double fcyc(test_funct f, void *argp)
     }
 #endif
     result = values[0];
+    bestvar = kbest_variance();
 #if !KEEP_VALS
     free(values);
     values = NULL;
@@ -173,6 +195,17 @@ double fcyc(test_funct f, void *argp)
 }
 
 
+/*
+ * get_fcyc_stats - Number of samples the last call to fcyc took,
+ *     and the variance of the K best of them in cycles squared
+ */
+void get_fcyc_stats(int *samples, double *variance)
+{
+    *samples = samplecount;
+    *variance = bestvar;
+}
+
+
 /*************************************************************
  * Set the various parameters used by the measurement routines
  ************************************************************/
@@ -230,6 +263,11 @@ void set_fcyc_k(int k)
     kbest = k;
 }
 
+int get_fcyc_k(void)
+{
+    return kbest;
+}
+
 /*
  * set_fcyc_maxsamples - Maximum number of samples attempting to find
  *     K-best within some tolerance.
@@ -250,6 +288,11 @@ void set_fcyc_epsilon(double epsilon_arg)
     epsilon = epsilon_arg;
 }
 
+double get_fcyc_epsilon(void)
+{
+    return epsilon;
+}
+
 
 
 
@@ -13,6 +13,10 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* Number of samples the last call to fcyc took, and the variance of
+   the K best of them */
+void get_fcyc_stats(int *samples, double *variance);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -48,6 +52,7 @@ void set_fcyc_compensate(int compensate_arg);
  *     Default = 3
  */
 void set_fcyc_k(int k);
+int get_fcyc_k(void);
 
 /* 
  * set_fcyc_maxsamples - Maximum number of samples attempting to find 
@@ -62,6 +67,7 @@ void set_fcyc_maxsamples(int maxsamples_arg);
  *     Default = 0.01
  */
 void set_fcyc_epsilon(double epsilon_arg);
+double get_fcyc_epsilon(void);
 
 
 
@@ -54,4 +54,21 @@ double fsecs(fsecs_test_funct f, void *argp)
 #endif
 }
 
+/*
+ * fsecs_stats - Number of samples the last call to fsecs took, and
+ *     the variance of the K best (in seconds squared); the timers
+ *     other than the cycle counter only give an average, so there
+ *     are none
+ */
+void fsecs_stats(int *samples, double *variance)
+{
+#if USE_FCYC
+    get_fcyc_stats(samples, variance);
+    *variance /= (Mhz * 1e6) * (Mhz * 1e6);
+#else
+    *samples = 0;
+    *variance = 0;
+#endif
+}
+
 
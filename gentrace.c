@@ -0,0 +1,451 @@
+/*
+ * gentrace.c - Writes synthetic traces, for stressing the mm package
+ *     where the recorded traces do not reach: many more requests or
+ *     live blocks, chosen size and lifetime distributions, realloc
+ *     chains and deliberately fragmenting patterns.
+ *
+ * usage: gentrace [-b] [-w <workload>] [-n <ops>] [-l <blocks>]
+ *                 [-S <sizes>] [-t <lifetimes>] [-g <growth>]
+ *                 [-r <seed>] <trace>
+ *
+ * Workloads (-w):
+ *   churn    Each block is freed once a lifetime, counted in allocs,
+ *            has passed since it was allocated (the default).
+ *   live     Allocates <blocks> blocks (default: a quarter of <ops>),
+ *            then frees one at random and allocates one in its place
+ *            until the end.
+ *   realloc  Grows <blocks> chains (default 64), picked at random, by
+ *            <growth> (default 1.5) times per realloc, each starting
+ *            over from a new block once it passes 64 KB.
+ *   frag     Allocates <blocks> blocks (default 1000, or a quarter of
+ *            <ops> if less) of one size, frees every other one, and goes
+ *            on to twice the size (plus a header), which cannot reuse the
+ *            holes; after 8 KB the survivors are freed and sizes start
+ *            again at 16 bytes.
+ *
+ * Sizes (-S) are uniform:<lo>:<hi>, power:<lo>:<hi>:<alpha> (a Pareto
+ * distribution cut off at hi; the default is power:16:4096:1.2) or
+ * bimodal:<a>:<b>:<p> (within 25% of a with probability p, else of b).
+ * Lifetimes (-t) are exp:<mean> (the default is exp:1000) or
+ * power:<min>:<alpha>. Every workload ends by freeing what is left, once
+ * it is at <ops> requests (default 100000). -b writes the binary format
+ * of bintrace.h instead of a .rep file; -r seeds the generator.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bintrace.h"
+
+#define CHAIN_MAX (1 << 16)    /* size past which a realloc chain starts over */
+#define FRAG_MIN  16           /* sizes of the rounds of frag */
+#define FRAG_MAX  8192
+
+/* A distribution of sizes or lifetimes */
+typedef struct {
+	char kind;             /* 'u'niform, 'p'ower, 'b'imodal or 'e'xp */
+	double a, b, c;
+} dist_t;
+
+/* A block of churn, freed at death */
+typedef struct {
+	long death;
+	int id;
+} mortal_t;
+
+static bintrace_op_t *ops;     /* the trace so far */
+static int num_ops, max_ops;
+static int num_ids;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* die - Print an error message and exit */
+static void die(const char *msg)
+{
+	fprintf(stderr, "gentrace: %s\n", msg);
+	exit(1);
+}
+
+/* usage - Print the usage message and exit */
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: gentrace [-b] [-w churn|live|realloc|frag] [-n <ops>] "
+		"[-l <blocks>]\n"
+		"                [-S <sizes>] [-t <lifetimes>] [-g <growth>] "
+		"[-r <seed>] <trace>\n");
+	exit(1);
+}
+
+/* rng - The next number of a xorshift64* generator */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniform - A random double in (0, 1] */
+static double uniform(void)
+{
+	return ((rng() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* below - A random integer in [0, n) */
+static int below(int n)
+{
+	return (int)(uniform() * n) % n;
+}
+
+/*
+ * parse_dist - Read a distribution of the form <kind>:<x>[:<y>[:<z>]]
+ */
+static dist_t parse_dist(const char *spec)
+{
+	dist_t d = {0, 0, 0, 0};
+	int n = 0;
+	const char *colon = strchr(spec, ':');
+
+	if (colon == NULL)
+		die("a distribution needs numbers after its kind");
+	n = sscanf(colon + 1, "%lf:%lf:%lf", &d.a, &d.b, &d.c);
+	if (!strncmp(spec, "uniform:", 8) && n == 2 && d.a >= 1 && d.b >= d.a)
+		d.kind = 'u';
+	else if (!strncmp(spec, "power:", 6) && n == 3 && d.a >= 1 && d.b >= d.a &&
+			d.c > 0)
+		d.kind = 'p';
+	else if (!strncmp(spec, "power:", 6) && n == 2 && d.a >= 1 && d.b > 0)
+		d.kind = 'P';      /* a lifetime: no upper bound */
+	else if (!strncmp(spec, "bimodal:", 8) && n == 3 && d.a >= 1 && d.b >= 1 &&
+			d.c >= 0 && d.c <= 1)
+		d.kind = 'b';
+	else if (!strncmp(spec, "exp:", 4) && n == 1 && d.a > 0)
+		d.kind = 'e';
+	else
+		die("bad distribution");
+	return d;
+}
+
+/* draw - A random number from d, at least 1 */
+static long draw(const dist_t *d)
+{
+	double x = 0, mode;
+
+	switch (d->kind) {
+		case 'u':
+			x = d->a + uniform() * (d->b - d->a + 1);
+			if (x > d->b)
+				x = d->b;
+			break;
+		case 'p':
+			/* The inverse of the distribution function, cut off at b */
+			x = d->a * pow(1 - uniform() * (1 - pow(d->a / d->b, d->c)),
+					-1 / d->c);
+			break;
+		case 'P':
+			x = d->a * pow(uniform(), -1 / d->b);
+			break;
+		case 'b':
+			mode = (uniform() <= d->c) ? d->a : d->b;
+			x = mode * (0.75 + 0.5 * uniform());
+			break;
+		case 'e':
+			x = -d->a * log(uniform());
+			break;
+	}
+	return (x < 1) ? 1 : (x > INT32_MAX) ? INT32_MAX : (long)x;
+}
+
+/* emit - Add a request to the trace */
+static void emit(int type, int index, size_t size)
+{
+	bintrace_op_t *op;
+
+	if (num_ops == max_ops) {
+		max_ops = (max_ops == 0) ? 4096 : 2 * max_ops;
+		if ((ops = realloc(ops, max_ops * sizeof(bintrace_op_t))) == NULL)
+			die(strerror(errno));
+	}
+	op = &ops[num_ops++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->index = index;
+	op->size = size;
+}
+
+/* new_block - Allocate a block of size bytes, and return its id */
+static int new_block(size_t size)
+{
+	emit(BINTRACE_ALLOC, num_ids, size);
+	return num_ids++;
+}
+
+/* heap_push, heap_pop - A min-heap of the live blocks of churn by death */
+static void heap_push(mortal_t *heap, int *n, mortal_t m)
+{
+	int i = (*n)++;
+
+	for (; i > 0 && heap[(i - 1) / 2].death > m.death; i = (i - 1) / 2)
+		heap[i] = heap[(i - 1) / 2];
+	heap[i] = m;
+}
+
+static mortal_t heap_pop(mortal_t *heap, int *n)
+{
+	mortal_t top = heap[0], last = heap[--(*n)];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < *n) {
+		if (child + 1 < *n && heap[child + 1].death < heap[child].death)
+			child++;
+		if (last.death <= heap[child].death)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+/*
+ * churn - Allocate blocks with lifetimes from lifetimes, freeing each
+ *     when its time comes, until there are about n requests
+ */
+static void churn(int n, const dist_t *sizes, const dist_t *lifetimes)
+{
+	mortal_t *heap, m;
+	int live = 0;
+	long now;
+
+	if ((heap = malloc((n / 2 + 1) * sizeof(mortal_t))) == NULL)
+		die(strerror(errno));
+	for (now = 0; num_ops + live < n; now++) {
+		while (live > 0 && heap[0].death <= now) {
+			m = heap_pop(heap, &live);
+			emit(BINTRACE_FREE, m.id, 0);
+		}
+		m.id = new_block(draw(sizes));
+		m.death = now + draw(lifetimes);
+		heap_push(heap, &live, m);
+	}
+	while (live > 0) {
+		m = heap_pop(heap, &live);
+		emit(BINTRACE_FREE, m.id, 0);
+	}
+	free(heap);
+}
+
+/*
+ * live - Allocate num_live blocks, and then keep replacing one at random
+ *     with a new one until there are about n requests
+ */
+static void live(int n, int num_live, const dist_t *sizes)
+{
+	int *blocks, i;
+
+	if (num_live > n / 2)
+		num_live = n / 2;
+	if (num_live < 1)
+		num_live = 1;
+	if ((blocks = malloc((num_live + 1) * sizeof(int))) == NULL)
+		die(strerror(errno));
+	for (i = 0; i < num_live; i++)
+		blocks[i] = new_block(draw(sizes));
+	while (num_ops + num_live + 2 <= n) {
+		i = below(num_live);
+		emit(BINTRACE_FREE, blocks[i], 0);
+		blocks[i] = new_block(draw(sizes));
+	}
+
+	/* Free them in a random order */
+	for (i = num_live - 1; i >= 0; i--) {
+		int j = below(i + 1), id = blocks[j];
+		blocks[j] = blocks[i];
+		emit(BINTRACE_FREE, id, 0);
+	}
+	free(blocks);
+}
+
+/*
+ * realloc_chains - Keep growing num_chains blocks by growth times with
+ *     realloc, until there are about n requests
+ */
+static void realloc_chains(int n, int num_chains, const dist_t *sizes,
+		double growth)
+{
+	int *ids, i;
+	size_t *chain_sizes, size;
+
+	ids = malloc(num_chains * sizeof(int));
+	chain_sizes = malloc(num_chains * sizeof(size_t));
+	if (ids == NULL || chain_sizes == NULL)
+		die(strerror(errno));
+	for (i = 0; i < num_chains; i++)
+		ids[i] = new_block(chain_sizes[i] = draw(sizes));
+	while (num_ops + num_chains + 1 < n) {
+		i = below(num_chains);
+		size = (size_t)(chain_sizes[i] * growth) + 1;
+		if (size > CHAIN_MAX) {
+			/* Start the chain over */
+			emit(BINTRACE_FREE, ids[i], 0);
+			ids[i] = new_block(chain_sizes[i] = draw(sizes));
+		} else {
+			emit(BINTRACE_REALLOC, ids[i], chain_sizes[i] = size);
+		}
+	}
+	for (i = 0; i < num_chains; i++)
+		emit(BINTRACE_FREE, ids[i], 0);
+	free(ids);
+	free(chain_sizes);
+}
+
+/*
+ * frag - Allocate rounds of blocks of doubling size, each round freeing
+ *     every other block of its own, until there are about n requests
+ */
+static void frag(int n, int per_round)
+{
+	int *survivors, num_survivors = 0, *round, i;
+	size_t size = FRAG_MIN;
+	int max_survivors = 0;
+
+	if (per_round > n / 4)
+		per_round = n / 4 + 1;
+	for (size = FRAG_MIN; size <= FRAG_MAX; size = 2 * size + 16)
+		max_survivors += (per_round + 1) / 2;
+	survivors = malloc(max_survivors * sizeof(int));
+	round = malloc(per_round * sizeof(int));
+	if (survivors == NULL || round == NULL)
+		die(strerror(errno));
+
+	size = FRAG_MIN;
+	while (num_ops + num_survivors + per_round + per_round / 2 <= n) {
+		for (i = 0; i < per_round; i++)
+			round[i] = new_block(size);
+		for (i = 0; i < per_round; i++) {
+			if (i % 2)
+				emit(BINTRACE_FREE, round[i], 0);
+			else
+				survivors[num_survivors++] = round[i];
+		}
+		size = 2 * size + 16;
+		if (size > FRAG_MAX) {
+			for (i = 0; i < num_survivors; i++)
+				emit(BINTRACE_FREE, survivors[i], 0);
+			num_survivors = 0;
+			size = FRAG_MIN;
+		}
+	}
+	for (i = 0; i < num_survivors; i++)
+		emit(BINTRACE_FREE, survivors[i], 0);
+	free(survivors);
+	free(round);
+}
+
+/* write_trace - Write the trace to filename, as text or binary */
+static void write_trace(const char *filename, int binary)
+{
+	FILE *out;
+	bintrace_hdr_t hdr;
+	bintrace_op_t *op;
+	int i;
+
+	if ((out = fopen(filename, "w")) == NULL)
+		die(strerror(errno));
+	if (binary) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+		hdr.version = BINTRACE_VERSION;
+		hdr.weight = 1;
+		hdr.num_ids = num_ids;
+		hdr.num_ops = num_ops;
+		if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+				fwrite(ops, sizeof(bintrace_op_t), num_ops, out) != (size_t)num_ops)
+			die(strerror(errno));
+	} else {
+		fprintf(out, "1 %d %d 0\n", num_ids, num_ops);
+		for (i = 0; i < num_ops; i++) {
+			op = &ops[i];
+			if (op->type == BINTRACE_FREE)
+				fprintf(out, "f %d\n", op->index);
+			else
+				fprintf(out, "%c %d %lu\n", op->type == BINTRACE_ALLOC ? 'a' : 'r',
+						op->index, (unsigned long)op->size);
+		}
+	}
+	if (fclose(out) != 0)
+		die(strerror(errno));
+}
+
+int main(int argc, char **argv)
+{
+	const char *workload = "churn";
+	dist_t sizes = parse_dist("power:16:4096:1.2");
+	dist_t lifetimes = parse_dist("exp:1000");
+	double growth = 1.5;
+	long n = 100000, blocks = 0;
+	int c, binary = 0;
+
+	while ((c = getopt(argc, argv, "bw:n:l:S:t:g:r:")) != EOF) {
+		switch (c) {
+			case 'b':
+				binary = 1;
+				break;
+			case 'w':
+				workload = optarg;
+				break;
+			case 'n':
+				n = atol(optarg);
+				break;
+			case 'l':
+				blocks = atol(optarg);
+				break;
+			case 'S':
+				sizes = parse_dist(optarg);
+				if (sizes.kind == 'e' || sizes.kind == 'P')
+					die("sizes need an upper bound");
+				break;
+			case 't':
+				lifetimes = parse_dist(optarg);
+				if (lifetimes.kind != 'e' && lifetimes.kind != 'P')
+					die("lifetimes are exp:<mean> or power:<min>:<alpha>");
+				break;
+			case 'g':
+				growth = atof(optarg);
+				break;
+			case 'r':
+				rng_state ^= strtoull(optarg, NULL, 0) * 0xbf58476d1ce4e5b9ULL;
+				if (rng_state == 0)
+					rng_state = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if (n < 2 || n > INT32_MAX / 2 || blocks < 0 || blocks > n)
+		die("bad number of requests or blocks");
+	if (growth <= 1)
+		die("the growth of a realloc chain must be more than 1");
+
+	if (!strcmp(workload, "churn"))
+		churn(n, &sizes, &lifetimes);
+	else if (!strcmp(workload, "live"))
+		live(n, blocks ? blocks : n / 4, &sizes);
+	else if (!strcmp(workload, "realloc"))
+		realloc_chains(n, blocks ? blocks : 64, &sizes, growth);
+	else if (!strcmp(workload, "frag"))
+		frag(n, blocks ? blocks : 1000);
+	else
+		die("unknown workload");
+	if (num_ids == 0)
+		die("too few requests for the workload");
+
+	write_trace(argv[optind], binary);
+	return 0;
+}
@@ -10,14 +10,23 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #ifndef __GCC__
 #  define __attribute__(args)
@@ -26,6 +35,10 @@
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fcyc.h"
+#include "ftimer.h"
+#include "clock.h"
+#include "bintrace.h"
 #include "config.h"
 
 /**********************
@@ -37,6 +50,29 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Parallel replay */
+#define PAR_PASSES    20 /* times each thread replays the whole trace set */
+#define PAR_RUNS       3 /* timed runs per thread count; the fastest is kept */
+#define HANDOFF_LEN 1024 /* pointers in flight from one thread to the next */
+
+/* Latency histograms */
+#define LAT_SUB_BITS   2 /* log2 of the buckets per power of two cycles */
+#define LAT_SUB       (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS   (64 * LAT_SUB)
+#define LAT_PASSES    10 /* times each trace is replayed to fill its histograms */
+
+/* Heap profile */
+#define PROFILE_INTERVAL 100 /* default number of requests between samples */
+#define PROFILE_BUCKETS   20 /* free sizes below 32, 32-63, ..., 2^23 and up */
+#define HEAP_SAMPLE_BYTES 4096 /* mean bytes allocated between samples for -S */
+
+/* Incremental heap checks */
+#define CHECK_WINDOW 64 /* blocks mm_checkheap_window checks per request at -d3 */
+
+/* Baseline comparison */
+#define REGRESSION_T  2.0 /* Welch's t past which a change in speed is significant */
+#define UTIL_TOLERANCE 0.001 /* smallest drop in utilization taken as a regression */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -51,25 +87,50 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload. The ranges of a trace
+ * form a treap: a binary search tree on lo that is also a max-heap on
+ * prio, which keeps it balanced in expectation.
+ */
 typedef struct range_t {
 	char *lo;              /* low payload address */
 	char *hi;              /* high payload address */
-	struct range_t *next;  /* next list element */
+	struct range_t *left;  /* ranges below this one */
+	struct range_t *right; /* ranges above this one */
+	unsigned long prio;    /* hash of lo; no child has a higher one */
 	int index;             /* same index as free; for debugging */
 } range_t;
 
+/*
+ * Types of trace operations; a MEMALIGN is an alloc with an alignment, and
+ * a BATCH_ALLOC or BATCH_FREE works on arg consecutive ids from index,
+ * all of one size, in one call
+ */
+enum { ALLOC, FREE, REALLOC, MEMALIGN, BATCH_ALLOC, BATCH_FREE, NUM_OP_TYPES };
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-	enum { ALLOC, FREE, REALLOC } type; /* type of request */
+	unsigned short type;              /* type of request */
+	unsigned short arg;               /* log2 alignment, or batch count */
 	int index;                        /* index for free() to use later */
 	size_t size;                      /* byte size of alloc/realloc request */
 } traceop_t;
 
+/* A binary trace's records are used in place as the traceop_t array */
+_Static_assert(sizeof(traceop_t) == sizeof(bintrace_op_t) &&
+		offsetof(traceop_t, arg) == offsetof(bintrace_op_t, arg) &&
+		offsetof(traceop_t, index) == offsetof(bintrace_op_t, index) &&
+		offsetof(traceop_t, size) == offsetof(bintrace_op_t, size),
+		"traceop_t does not match the binary trace format");
+_Static_assert(ALLOC == BINTRACE_ALLOC && FREE == BINTRACE_FREE &&
+		REALLOC == BINTRACE_REALLOC && MEMALIGN == BINTRACE_MEMALIGN &&
+		BATCH_ALLOC == BINTRACE_BATCH_ALLOC && BATCH_FREE == BINTRACE_BATCH_FREE,
+		"request types do not match the binary trace format");
+
 /* Holds the information for one trace file*/
 typedef struct {
 	char filename[MAXLINE];
-	int ignore_ranges;   /* don't check ranges (i.e. this is too big) */
+	int ignore_ranges;   /* unused: every trace's ranges are checked now */
 	int num_ids;         /* number of alloc/realloc ids */
 	int num_ops;         /* number of distinct requests */
 	int weight;          /* weight for this trace (unused) */
@@ -77,6 +138,8 @@ typedef struct {
 	char **blocks;       /* array of ptrs returned by malloc/realloc... */
 	size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 	int *block_rand_base;/* index into random_data, if debug is on */
+	void *map;           /* mapping of a binary trace file, which ops is in */
+	size_t map_len;
 } trace_t;
 
 /*
@@ -89,6 +152,58 @@ typedef struct {
 	range_t *ranges;
 } speed_t;
 
+/*
+ * Log-bucketed histograms of the cycles that each type of request
+ * took on one trace, indexed by the op type. Bucket b counts the
+ * latencies from lat_bucket_lo(b) to lat_bucket_hi(b).
+ */
+typedef struct {
+	unsigned long counts[NUM_OP_TYPES][LAT_BUCKETS];
+	unsigned long n[NUM_OP_TYPES];  /* number of requests of each type */
+	double max[NUM_OP_TYPES];       /* the slowest request of each type */
+} latency_t;
+
+/* Summarizes one walk over the mm heap, for the heap profile */
+typedef struct {
+	unsigned long alloc_blocks;
+	unsigned long free_blocks;
+	size_t free_bytes;
+	size_t largest_free;
+	unsigned long free_sizes[PROFILE_BUCKETS]; /* free blocks per power of two */
+} heapprof_t;
+
+#ifdef THREAD_SAFE
+/*
+ * In producer/consumer mode each replay thread passes the blocks its
+ * trace frees to the next thread, which frees them instead. A handoff_t
+ * is a single-producer single-consumer ring of those pointers.
+ */
+typedef struct {
+	void *slots[HANDOFF_LEN];
+	unsigned head;         /* next slot to take; written by the consumer */
+	unsigned tail;         /* next slot to fill; written by the producer */
+	int done;              /* the producer will put no more pointers */
+} handoff_t;
+
+/* Holds the params of one thread of eval_mm_parallel */
+typedef struct {
+	trace_t **traces;      /* the thread's own copies of the traces */
+	int num_traces;
+	int first;             /* the thread replays traces first, first + step, ... */
+	int step;
+	handoff_t *out;        /* where frees are passed (producer/consumer only) */
+	handoff_t *in;         /* where frees are taken from */
+} replay_t;
+
+/* Holds the params to eval_mm_parallel, which is timed by ftimer */
+typedef struct {
+	int num_threads;
+	pthread_t *tids;
+	replay_t *replays;     /* one per thread */
+	handoff_t *handoffs;   /* one per thread, or NULL */
+} parallel_t;
+#endif
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
 	/* set in read_trace */
@@ -103,6 +218,12 @@ typedef struct {
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
 
+	/* how secs was measured */
+	int runs;        /* number of times secs was measured; secs is their mean */
+	double secs_sd;  /* standard deviation of secs over those runs */
+	int samples;     /* samples the timer took, over all of the runs */
+	double secs_var; /* mean variance of the samples of a run, in secs^2 */
+
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -112,7 +233,10 @@ typedef struct {
  * at a "random" place (a hash of the index), and copy random data
  * into it.  With DBG_CHEAP, we check that the data survived when we
  * realloc and when we free.  With DBG_EXPENSIVE, we check every block
- * every operation.
+ * every operation.  DBG_WINDOW instead has the heap check the next
+ * CHECK_WINDOW of its blocks every operation, and DBG_TOUCHED has malloc
+ * and free check the blocks they touch, which keeps checking affordable on
+ * large traces.
  * randint_t should be a byte, in case students return unaligned memory.
  *******************/
 #define RANDOM_DATA_LEN (1<<16)
@@ -125,10 +249,17 @@ static randint_t random_data[RANDOM_DATA_LEN];
  * Global variables
  *******************/
 
-static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
+static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE, DBG_WINDOW, DBG_TOUCHED }
+	debug_mode = DBG_CHEAP;
 
 int verbose = 2;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static const char *op_names[] = { "malloc", "free", "realloc", "memalign",
+	"malloc_batch", "free_batch" };
+static FILE *profile_file = NULL;  /* if set, eval_mm_util samples the heap... */
+static int profile_interval = PROFILE_INTERVAL; /* ...every this many ops */
+static char *sample_prefix = NULL; /* if set, a replay writes pprof profiles */
+static int speed_runs = 1;  /* times the speed of each trace is measured */
 int onetime_flag = 0;
 
 /* Directory where default tracefiles are found */
@@ -148,6 +279,11 @@ static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void split_ranges(range_t *root, char *lo, range_t **left,
+		range_t **right);
+static range_t *merge_ranges(range_t *left, range_t *right);
+static void check_ranges(const range_t *root, const trace_t *trace,
+		int opnum);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -157,18 +293,60 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename);
+static int map_bintrace(trace_t *trace, FILE *tracefile);
+static void parse_trace_ops(trace_t *trace, FILE *tracefile);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
+static void *libc_alloc_op(const traceop_t *op);
 static int eval_libc_valid(trace_t *trace);
 static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
+static void *mm_alloc_op(const traceop_t *op);
+static int eval_mm_oversize(trace_t *trace);
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, int sample);
 static void eval_mm_speed(void *ptr);
+static void profile_visit(void *block, size_t size, int allocated, void *arg);
+static void profile_heap(const trace_t *trace, int opnum, int live_bytes);
+static void write_heap_sample(int tracenum);
+static size_t trace_peak(trace_t *trace, int *peak_op);
+
+/* Routines for measuring the latency of every mm malloc request */
+static void eval_mm_latency(trace_t *trace, latency_t *lat);
+static double counter_overhead(void);
+static void lat_record(latency_t *lat, int type, double cycles);
+static double lat_bucket_lo(int bucket);
+static double lat_bucket_hi(int bucket);
+static double lat_percentile(const latency_t *lat, int type, double p);
+static void print_latency(int n, stats_t *stats, latency_t *lat);
+static void write_latency_csv(const char *filename, int n, stats_t *stats,
+		latency_t *lat);
+
+/* Routines for replaying traces on several threads at once, to see
+   how the mm malloc package scales */
+#ifdef THREAD_SAFE
+static void run_parallel_tests(int num_tracefiles, const char *tracedir,
+		char **tracefiles, int max_threads, int producer_consumer, int split);
+static trace_t *copy_trace(const trace_t *trace);
+static int handoff_put(handoff_t *q, void *p);
+static void *handoff_get(handoff_t *q);
+static void replay_free(void *p, handoff_t *out, handoff_t *in);
+static void replay_trace(trace_t *trace, handoff_t *out, handoff_t *in);
+static void *replay_thread(void *ptr);
+static void eval_mm_parallel(void *ptr);
+#endif
+
+/* Routines for saving the results, and comparing them with saved ones */
+static void measure_speed(stats_t *stats, fsecs_test_funct f, void *argp);
+static void check_result_names(int n, const char *tracedir, char **tracefiles);
+static void write_results(const char *filename, int n, stats_t *stats,
+		double perfindex);
+static stats_t *read_results(const char *filename, int *n);
+static int compare_results(int n, stats_t *stats, const char *filename);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -184,7 +362,8 @@ static void app_error(const char *fmt, ...)
    num_tracefiles, if there's a timeout) */
 static void run_tests(int num_tracefiles, const char *tracedir,
 		char **tracefiles,
-		stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
+		stats_t *mm_stats, range_t *ranges, speed_t *speed_params,
+		latency_t *mm_latency) {
 	volatile int i;
 
 	for (i=0; i < num_tracefiles; i++) {
@@ -194,7 +373,9 @@ static void run_tests(int num_tracefiles, const char *tracedir,
 		mm_stats[i].ops = trace->num_ops;
 		if (verbose > 1)
 			printf("Checking mm_malloc for correctness, ");
+		mm_checkheap_touched(debug_mode == DBG_TOUCHED, verbose);
 		mm_stats[i].valid = eval_mm_valid(trace, &ranges);
+		mm_checkheap_touched(0, verbose);
 
 		if (onetime_flag) {
 			free_trace(trace);
@@ -203,12 +384,16 @@ static void run_tests(int num_tracefiles, const char *tracedir,
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			mm_stats[i].util = eval_mm_util(trace, i, 0);
+			if (sample_prefix != NULL)
+				eval_mm_util(trace, i, 1);
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
 			if (verbose > 1)
 				printf("and performance.\n");
-			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			measure_speed(&mm_stats[i], eval_mm_speed, speed_params);
+			if (mm_latency != NULL)
+				eval_mm_latency(trace, &mm_latency[i]);
 		}
 		free_trace(trace);
 	}
@@ -228,8 +413,21 @@ int main(int argc, char **argv)
 	stats_t *libc_stats = NULL;/* libc stats for each trace */
 	stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
 	speed_t speed_params;      /* input parameters to the xx_speed routines */
+	latency_t *mm_latency = NULL; /* mm latency histograms for each trace */
 
 	int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+	int run_latency = 0;  /* If set, time every mm request (set by -L) */
+	char *latency_csv = NULL; /* If set, write the histograms here (-H) */
+	char *results_file = NULL; /* If set, write the results here (-o) */
+	char *baseline_file = NULL; /* If set, compare with these results (-b) */
+	int fcyc_k = 0;       /* If set, the K of the K-best timing (-K) */
+	double fcyc_epsilon = 0; /* If set, the tolerance of the K best (-E) */
+	int regressions = 0;
+#ifdef THREAD_SAFE
+	int max_threads = 0;  /* If set, replay traces on up to this many threads (-T) */
+	int producer_consumer = 0; /* If set, free on another thread (set by -p) */
+	int split = 0;        /* If set, share the traces out over the threads (-s) */
+#endif
 
 	/* temporaries used to compute the performance index */
 	double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
@@ -243,16 +441,16 @@ int main(int argc, char **argv)
 	/*
 	 * Read and interpret the command line arguments
 	 */
-	while ((c = getopt(argc, argv, "d:f:c:t:hlD")) != EOF) {
+	while ((c = getopt(argc, argv, "d:f:c:t:T:H:i:P:S:o:b:r:K:E:hlLpsD")) != EOF) {
 		switch (c) {
 
-			case 'f': /* Use one specific trace file only (relative to curr dir) */
-				num_tracefiles = 1;
-				if ((tracefiles = realloc(tracefiles, 2 * sizeof(char *))) == NULL)
+			case 'f': /* Use this trace file, and any other given by -f */
+				if ((tracefiles = realloc(tracefiles,
+								(num_tracefiles + 2) * sizeof(char *))) == NULL)
 					unix_error("ERROR: realloc failed in main");
-				strcpy(tracedir, "./");
-				tracefiles[0] = strdup(optarg);
-				tracefiles[1] = NULL;
+				tracedir[0] = '\0';
+				tracefiles[num_tracefiles++] = strdup(optarg);
+				tracefiles[num_tracefiles] = NULL;
 				break;
 
 			case 'c': /* Use one specific trace file and run only once */
@@ -260,13 +458,13 @@ int main(int argc, char **argv)
 				onetime_flag = 1;
 				if ((tracefiles = realloc(tracefiles, 2 * sizeof(char *))) == NULL)
 					unix_error("ERROR: realloc failed in main");
-				strcpy(tracedir, "./");
+				tracedir[0] = '\0';
 				tracefiles[0] = strdup(optarg);
 				tracefiles[1] = NULL;
 				break;
 
 			case 't': /* Directory where the traces are located */
-				if (num_tracefiles == 1) /* ignore if -f already encountered */
+				if (num_tracefiles > 0) /* ignore if -f already encountered */
 					break;
 				strcpy(tracedir, optarg);
 				if (tracedir[strlen(tracedir)-1] != '/')
@@ -277,6 +475,78 @@ int main(int argc, char **argv)
 				run_libc = 1;
 				break;
 
+			case 'L': /* Time every request of the mm malloc package */
+				run_latency = 1;
+				break;
+
+			case 'P': /* Write a profile of the heap over time to a CSV file */
+				if ((profile_file = fopen(optarg, "w")) == NULL)
+					unix_error("Could not open %s in main", optarg);
+				break;
+
+			case 'i': /* Number of requests between samples of the profile */
+				profile_interval = atoi(optarg);
+				if (profile_interval < 1)
+					app_error("-i needs a positive number of requests\n");
+				break;
+
+			case 'S': /* Write a pprof heap profile of each trace at its peak */
+				sample_prefix = optarg;
+				break;
+
+			case 'H': /* Write the latency histograms to a CSV file */
+				run_latency = 1;
+				latency_csv = optarg;
+				break;
+
+			case 'o': /* Write the results to a JSON or CSV file */
+				results_file = optarg;
+				break;
+
+			case 'b': /* Compare the results with those saved by -o */
+				baseline_file = optarg;
+				break;
+
+			case 'r': /* Measure the speed of each trace this many times */
+				speed_runs = atoi(optarg);
+				if (speed_runs < 1)
+					app_error("-r needs a positive number of runs\n");
+				break;
+
+			case 'K': /* K of the K-best timing scheme */
+				fcyc_k = atoi(optarg);
+				if (fcyc_k < 1)
+					app_error("-K needs a positive K\n");
+				break;
+
+			case 'E': /* How close the K best times must be */
+				fcyc_epsilon = atof(optarg);
+				if (fcyc_epsilon <= 0)
+					app_error("-E needs a positive tolerance\n");
+				break;
+
+#ifdef THREAD_SAFE
+			case 'T': /* Replay the traces on up to this many threads */
+				max_threads = atoi(optarg);
+				if (max_threads < 1)
+					app_error("-T needs a positive thread count\n");
+				break;
+
+			case 'p': /* Free each block on another thread than malloced it */
+				producer_consumer = 1;
+				break;
+
+			case 's': /* Replay trace i on thread i, not every trace on each */
+				split = 1;
+				break;
+#else
+			case 'T':
+			case 'p':
+			case 's':
+				app_error("-%c needs the thread-safe driver, mdriver-ts\n", c);
+				break;
+#endif
+
 			case 'd':
 				debug_mode = atoi(optarg);
 				break;
@@ -301,12 +571,19 @@ int main(int argc, char **argv)
 		printf("Using default tracefiles in %s\n", tracedir);
 	}
 
+	if (results_file != NULL)
+		check_result_names(num_tracefiles, tracedir, tracefiles);
+
 	if(debug_mode != DBG_NONE) {
 		init_random_data();
 	}
 
 	/* Initialize the timing package */
 	init_fsecs();
+	if (fcyc_k > 0)
+		set_fcyc_k(fcyc_k);
+	if (fcyc_epsilon > 0)
+		set_fcyc_epsilon(fcyc_epsilon);
 
 	/*
 	 * Optionally run and evaluate the libc malloc package
@@ -331,7 +608,7 @@ int main(int argc, char **argv)
 				speed_params.trace = trace;
 				if (verbose > 1)
 					printf("and performance.\n");
-				libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+				measure_speed(&libc_stats[i], eval_libc_speed, &speed_params);
 			}
 			free_trace(trace);
 		}
@@ -354,11 +631,27 @@ int main(int argc, char **argv)
 	if (mm_stats == NULL)
 		unix_error("mm_stats calloc in main failed");
 
+	/* Allocate the latency histograms, if the requests are to be timed */
+	if (run_latency && !onetime_flag) {
+		mm_latency = (latency_t *)calloc(num_tracefiles, sizeof(latency_t));
+		if (mm_latency == NULL)
+			unix_error("mm_latency calloc in main failed");
+	}
+
+	/* Name the columns of the heap profile */
+	if (profile_file != NULL) {
+		fprintf(profile_file, "trace,op,live_bytes,heap_bytes,mapped_bytes,alloc_blocks,"
+				"free_blocks,free_bytes,largest_free,ext_frag,free_lt32");
+		for (i = 5; i < 4 + PROFILE_BUCKETS; i++)
+			fprintf(profile_file, ",free_%lu", 1UL << i);
+		fprintf(profile_file, "\n");
+	}
+
 	/* Initialize the simulated memory system in memlib.c */
 	mem_init();
 
 	run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
-			ranges, &speed_params);
+			ranges, &speed_params, mm_latency);
 
 
 	/* Display the mm results in a compact table */
@@ -377,6 +670,30 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (profile_file != NULL)
+		fclose(profile_file);
+
+	/* Display the tail latencies, and optionally save the histograms */
+	if (mm_latency != NULL) {
+		if (verbose) {
+			printf("Latency of mm malloc requests, in cycles:\n");
+			print_latency(num_tracefiles, mm_stats, mm_latency);
+			printf("\n");
+		}
+		if (latency_csv != NULL)
+			write_latency_csv(latency_csv, num_tracefiles, mm_stats,
+					mm_latency);
+	}
+
+	/*
+	 * Optionally measure how the mm package scales over threads
+	 */
+#ifdef THREAD_SAFE
+	if (max_threads > 0 && errors == 0 && !onetime_flag)
+		run_parallel_tests(num_tracefiles, tracedir, tracefiles,
+				max_threads, producer_consumer, split);
+#endif
+
 	/*
 	 * Accumulate the aggregate statistics for the student's mm package
 	 */
@@ -444,27 +761,39 @@ int main(int argc, char **argv)
         printf("Score = 0/70\n");
 	}
 
-	exit(0);
+	/*
+	 * Optionally save the results, and compare them with a baseline
+	 */
+	if (!onetime_flag) {
+		if (results_file != NULL)
+			write_results(results_file, num_tracefiles, mm_stats, perfindex);
+		if (baseline_file != NULL)
+			regressions = compare_results(num_tracefiles, mm_stats,
+					baseline_file);
+	}
+
+	exit(regressions > 0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks, in time
+ * logarithmic in the number of blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index)
 {
 	char *hi = lo + size - 1;
-	range_t *p;
+	range_t *p, *r;
 
 	assert(size > 0);
 
@@ -475,24 +804,32 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* The payload must lie within the extent of the heap */
-	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+	/* The payload must lie within the extent of the heap, or of one of
+	   the mappings the package made with mem_mmap */
+	if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+			!mem_is_mapped(lo, size)) {
 		malloc_error(trace, opnum,
 				"Payload (%p:%p) lies outside heap (%p:%p)",
 				lo, hi, mem_heap_lo(), mem_heap_hi());
 		return 0;
 	}
 
-	/* If we can't afford the linear-time loop, we check less thoroughly and
-	   just assume the overlap will be caught by writing random bits. */
-	if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
-
+	/* The package must report at least the requested size as usable */
+	if (mm_malloc_usable_size(lo) < (size_t)size) {
+		malloc_error(trace, opnum,
+				"Payload (%p) has %lu usable bytes, fewer than its %d", lo,
+				(unsigned long)mm_malloc_usable_size(lo), size);
+		return 0;
+	}
 
-	/* The payload must not overlap any other payloads */
-	for (p = *ranges;  p != NULL;  p = p->next) {
-		if ((lo >= p->lo && lo <= p-> hi) ||
-				(hi >= p->lo && hi <= p->hi)) {
+	/*
+	 * The payload must not overlap any other payloads. The ranges in
+	 * the tree never overlap each other, so any range that is neither
+	 * wholly below nor wholly above this payload overlaps it.
+	 */
+	for (p = *ranges;  p != NULL;  p = (p->hi < lo) ? p->right : p->left) {
+		if (p->hi >= lo && p->lo <= hi) {
 			malloc_error(trace, opnum,
 					"Payload (%p:%p) overlaps another payload (%p:%p)\n",
 					lo, hi, p->lo, p->hi);
@@ -501,16 +838,21 @@ static int add_range(range_t **ranges, char *lo, int size,
 	}
 
 	/*
-	 * Everything looks OK, so remember the extent of this block
-	 * by creating a range struct and adding it the range list.
+	 * Everything looks OK, so remember the extent of this block by
+	 * creating a range struct and adding it the range tree: below the
+	 * first range on the way down with a lower priority, which is
+	 * split around it.
 	 */
-	if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
+	if ((r = (range_t *)malloc(sizeof(range_t))) == NULL)
 		unix_error("malloc error in add_range");
-	p->next = *ranges;
-	p->lo = lo;
-	p->hi = hi;
-	p->index = index;
-	*ranges = p;
+	r->lo = lo;
+	r->hi = hi;
+	r->prio = (unsigned long)lo * 0x9e3779b97f4a7c15UL;
+	r->index = index;
+	while (*ranges != NULL && (*ranges)->prio > r->prio)
+		ranges = (lo < (*ranges)->lo) ? &(*ranges)->left : &(*ranges)->right;
+	split_ranges(*ranges, lo, &r->left, &r->right);
+	*ranges = r;
 
 	return 1;
 }
@@ -521,15 +863,12 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo)
 {
 	range_t *p;
-	range_t **prevpp = ranges;
 
-	for (p = *ranges;  p != NULL; p = p->next) {
-		if (p->lo == lo) {
-			*prevpp = p->next;
-			free(p);
-			break;
-		}
-		prevpp = &(p->next);
+	while ((p = *ranges) != NULL && p->lo != lo)
+		ranges = (lo < p->lo) ? &p->left : &p->right;
+	if (p != NULL) {
+		*ranges = merge_ranges(p->left, p->right);
+		free(p);
 	}
 }
 
@@ -538,14 +877,60 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-	range_t *p;
-	range_t *pnext;
+	if (*ranges == NULL)
+		return;
+	clear_ranges(&(*ranges)->left);
+	clear_ranges(&(*ranges)->right);
+	free(*ranges);
+	*ranges = NULL;
+}
 
-	for (p = *ranges;  p != NULL;  p = pnext) {
-		pnext = p->next;
-		free(p);
+/*
+ * split_ranges - split the range tree root into the ranges below lo,
+ *     put in *left, and the rest, put in *right
+ */
+static void split_ranges(range_t *root, char *lo, range_t **left,
+		range_t **right)
+{
+	if (root == NULL) {
+		*left = *right = NULL;
+	} else if (root->lo < lo) {
+		split_ranges(root->right, lo, &root->right, right);
+		*left = root;
+	} else {
+		split_ranges(root->left, lo, left, &root->left);
+		*right = root;
+	}
+}
+
+/*
+ * merge_ranges - join two range trees, all of whose left ranges lie
+ *     below all of its right ranges, into one
+ */
+static range_t *merge_ranges(range_t *left, range_t *right)
+{
+	if (left == NULL)
+		return right;
+	if (right == NULL)
+		return left;
+	if (left->prio > right->prio) {
+		left->right = merge_ranges(left->right, right);
+		return left;
+	}
+	right->left = merge_ranges(left, right->left);
+	return right;
+}
+
+/*
+ * check_ranges - check the data of every block in the range tree
+ */
+static void check_ranges(const range_t *root, const trace_t *trace,
+		int opnum)
+{
+	for (; root != NULL; root = root->right) {
+		check_ranges(root->left, trace, opnum);
+		check_index(trace, opnum, root->index);
 	}
-	*ranges = NULL;
 }
 
 /**********************************************
@@ -622,10 +1007,6 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 {
 	FILE *tracefile;
 	trace_t *trace;
-	char type[MAXLINE];
-	int index, size;
-	int max_index = 0;
-	int op_index;
 
 	if (verbose > 1)
 		printf("Reading tracefile: %s\n", filename);
@@ -640,10 +1021,12 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	if ((tracefile = fopen(trace->filename, "r")) == NULL) {
 		unix_error("Could not open %s in read_trace", trace->filename);
 	}
-	assert(fscanf(tracefile, "%d", &trace->weight) != EOF);
-	assert(fscanf(tracefile, "%d", &trace->num_ids) != EOF);
-	assert(fscanf(tracefile, "%d", &trace->num_ops) != EOF);
-	assert(fscanf(tracefile, "%d", &trace->ignore_ranges) != EOF);
+	if (!map_bintrace(trace, tracefile)) {
+		assert(fscanf(tracefile, "%d", &trace->weight) != EOF);
+		assert(fscanf(tracefile, "%d", &trace->num_ids) != EOF);
+		assert(fscanf(tracefile, "%d", &trace->num_ops) != EOF);
+		assert(fscanf(tracefile, "%d", &trace->ignore_ranges) != EOF);
+	}
 
 	if(trace->weight != 0 && trace->weight != 1) {
 		app_error("%s: weight can only be zero or one", trace->filename);
@@ -652,8 +1035,9 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		app_error("%s: ignore-ranges can only be zero or one", trace->filename);
 	}
 
-	/* We'll store each request line in the trace in this array */
-	if ((trace->ops =
+	/* We'll store each request line in the trace in this array,
+	   unless it is already mapped from a binary trace */
+	if (trace->map == NULL && (trace->ops =
 				(traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 		unix_error("malloc 2 failed in read_trace");
 
@@ -673,10 +1057,115 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		unix_error("malloc 5 failed in read_trace");
 
 
+	if (trace->map == NULL)
+		parse_trace_ops(trace, tracefile);
+	fclose(tracefile);
+
+	/* fill in the stats */
+	strcpy(stats->filename, trace->filename);
+	stats->weight = trace->weight;
+	stats->ops = trace->num_ops;
+
+	return trace;
+}
+
+/*
+ * map_bintrace - If tracefile is a binary trace, map it and point the
+ *     trace's ops at its records; return 0 if it is a text trace. The
+ *     mapping is read sequentially, so that the kernel can page a trace
+ *     larger than memory in and out as it is replayed. Its records are
+ *     checked in one pass, as parse_trace_ops checks a text trace.
+ */
+static int map_bintrace(trace_t *trace, FILE *tracefile)
+{
+	bintrace_hdr_t hdr;
+	struct stat st;
+	const traceop_t *op;
+	int i, count, last, max_index = 0;
+
+	trace->map = NULL;
+	if (fread(&hdr, sizeof(hdr), 1, tracefile) != 1 ||
+			memcmp(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+		rewind(tracefile);
+		return 0;
+	}
+	if (hdr.version != BINTRACE_VERSION)
+		app_error("%s: unknown binary trace version %u; convert it again "
+				"with rep2bin\n", trace->filename, hdr.version);
+	if (fstat(fileno(tracefile), &st) < 0)
+		unix_error("Could not stat %s in map_bintrace", trace->filename);
+	if (hdr.num_ops < 0 || (size_t)st.st_size !=
+			sizeof(hdr) + (size_t)hdr.num_ops * sizeof(bintrace_op_t))
+		app_error("%s: binary trace is truncated\n", trace->filename);
+
+	trace->map_len = st.st_size;
+	trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE,
+			fileno(tracefile), 0);
+	if (trace->map == MAP_FAILED)
+		unix_error("Could not mmap %s in map_bintrace", trace->filename);
+	madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+
+	trace->weight = hdr.weight;
+	trace->num_ids = hdr.num_ids;
+	trace->num_ops = hdr.num_ops;
+	trace->ignore_ranges = hdr.ignore_ranges;
+	trace->ops = (traceop_t *)((char *)trace->map + sizeof(hdr));
+
+	/* check the requests as parse_trace_ops would, in one pass */
+	for (i = 0; i < trace->num_ops; i++) {
+		op = &trace->ops[i];
+		if (op->type >= NUM_OP_TYPES)
+			app_error("%s: request %d has bogus type %u\n",
+					trace->filename, i, op->type);
+		count = 1;
+		if (op->type == BATCH_ALLOC || op->type == BATCH_FREE) {
+			if (op->arg == 0)
+				app_error("%s: request %d is a batch of no blocks\n",
+						trace->filename, i);
+			count = op->arg;
+		} else if (op->type == MEMALIGN) {
+			if (op->arg >= 8 * sizeof(size_t))
+				app_error("%s: request %d has bogus alignment 2^%u\n",
+						trace->filename, i, op->arg);
+		} else if (op->arg != 0)
+			app_error("%s: request %d of type %u has bogus arg %u\n",
+					trace->filename, i, op->type, op->arg);
+		/* the rest of mdriver keeps sizes in ints, as text traces do */
+		if (op->size > INT_MAX)
+			app_error("%s: request %d has bogus size %zu\n",
+					trace->filename, i, op->size);
+		/* index + count could overflow, so compare index against the rest */
+		if ((op->index < 0 && !(op->type == FREE && op->index == -1)) ||
+				op->index > trace->num_ids - count)
+			app_error("%s: request %d names %d ids from id %d of %d ids\n",
+					trace->filename, i, count, op->index, trace->num_ids);
+		last = op->index + (count - 1);
+		if (op->type != FREE && op->type != BATCH_FREE && last > max_index)
+			max_index = last;
+	}
+	if (max_index != trace->num_ids - 1)
+		app_error("%s: the requests allocate %d ids, not the %d of the header\n",
+				trace->filename, max_index + 1, trace->num_ids);
+	return 1;
+}
+
+/*
+ * parse_trace_ops - read every request line of a text trace into the
+ *     trace's ops
+ */
+static void parse_trace_ops(trace_t *trace, FILE *tracefile)
+{
+	char type[MAXLINE];
+	int index, size;
+	unsigned int align, count;
+	int max_index = 0;
+	int op_index;
+
 	/* read every request line in the trace file */
 	index = 0;
 	op_index = 0;
 	while (fscanf(tracefile, "%s", type) != EOF) {
+		trace->ops[op_index].arg = 0;
 		switch(type[0]) {
 			case 'a':
 				assert(fscanf(tracefile, "%u %u", &index, &size) != EOF);
@@ -697,6 +1186,31 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 				trace->ops[op_index].type = FREE;
 				trace->ops[op_index].index = index;
 				break;
+			case 'm':
+				assert(fscanf(tracefile, "%u %u %u", &index, &size, &align) != EOF);
+				if (align == 0 || (align & (align - 1)) != 0)
+					app_error("Alignment %u of a memalign in tracefile %s is not "
+							"a power of two", align, trace->filename);
+				trace->ops[op_index].type = MEMALIGN;
+				trace->ops[op_index].arg = __builtin_ctz(align);
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'b':
+			case 'B':
+				assert(fscanf(tracefile, "%u %u %u", &index, &count, &size) != EOF);
+				if (count == 0 || count > USHRT_MAX)
+					app_error("Batch of %u blocks in tracefile %s is not "
+							"between 1 and %u", count, trace->filename, USHRT_MAX);
+				trace->ops[op_index].type = (type[0] == 'b') ? BATCH_ALLOC : BATCH_FREE;
+				trace->ops[op_index].arg = count;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				if (type[0] == 'b')
+					max_index = (index + (int)count - 1 > max_index) ?
+						index + (int)count - 1 : max_index;
+				break;
 			default:
 				app_error("Bogus type character (%c) in tracefile %s\n",
 						type[0], trace->filename);
@@ -704,16 +1218,8 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		op_index++;
 		if(op_index == trace->num_ops) break;
 	}
-	fclose(tracefile);
 	assert(max_index == trace->num_ids - 1);
 	assert(trace->num_ops == op_index);
-
-	/* fill in the stats */
-	strcpy(stats->filename, trace->filename);
-	stats->weight = trace->weight;
-	stats->ops = trace->num_ops;
-
-	return trace;
 }
 
 /*
@@ -728,12 +1234,16 @@ static void reinit_trace(trace_t *trace)
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated (or, for the requests
+ *              of a binary trace, mapped) in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-	free(trace->ops);         /* free the three arrays... */
-	free(trace->blocks);
+	if (trace->map != NULL)   /* unmap or free the requests... */
+		munmap(trace->map, trace->map_len);
+	else
+		free(trace->ops);
+	free(trace->blocks);      /* and the three arrays... */
 	free(trace->block_sizes);
 	free(trace->block_rand_base);
 	free(trace);              /* and the trace record itself... */
@@ -744,14 +1254,61 @@ static void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * mm_alloc_op - Run an alloc request of a trace through the mm malloc
+ *     package: mm_malloc, or mm_memalign for a MEMALIGN request
+ */
+static void *mm_alloc_op(const traceop_t *op)
+{
+	if (op->type == MEMALIGN)
+		return mm_memalign((size_t)1 << op->arg, op->size);
+	return mm_malloc(op->size);
+}
+
+/*
+ * eval_mm_oversize - Check that the mm malloc package fails with
+ *     ENOMEM on requests too large for any block, rather than handing
+ *     out a small block once the size wraps around in rounding
+ */
+static int eval_mm_oversize(trace_t *trace)
+{
+	size_t size = SIZE_MAX - 10;
+	char *p, *newp;
+
+	errno = 0;
+	if ((p = mm_malloc(size)) != NULL || errno != ENOMEM) {
+		malloc_error(trace, 0, "mm_malloc of %zu bytes did not fail with "
+				"ENOMEM", size);
+		return 0;
+	}
+	errno = 0;
+	if ((p = mm_calloc(1, size)) != NULL || errno != ENOMEM) {
+		malloc_error(trace, 0, "mm_calloc of %zu bytes did not fail with "
+				"ENOMEM", size);
+		return 0;
+	}
+	if ((p = mm_malloc(16)) == NULL) {
+		malloc_error(trace, 0, "mm_malloc failed.");
+		return 0;
+	}
+	errno = 0;
+	if ((newp = mm_realloc(p, size)) != NULL || errno != ENOMEM) {
+		malloc_error(trace, 0, "mm_realloc to %zu bytes did not fail with "
+				"ENOMEM", size);
+		return 0;
+	}
+	mm_free(p);
+	return 1;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static int eval_mm_valid(trace_t *trace, range_t **ranges)
 {
-	int i;
+	int i, j;
 	int index;
-	size_t size;
+	size_t size, align, count;
 	char *newp;
 	char *oldp;
 	char *p;
@@ -766,6 +1323,8 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 		malloc_error(trace, 0, "mm_init failed.");
 		return 0;
 	}
+	if (!eval_mm_oversize(trace))
+		return 0;
 
 	/* Interpret each operation in the trace in order */
 	for (i = 0;  i < trace->num_ops;  i++) {
@@ -773,26 +1332,31 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 		size = trace->ops[i].size;
 
 		if(debug_mode == DBG_EXPENSIVE) {
-			range_t *r;
-
 			/* Let the students check their own heap */
 			mm_checkheap(verbose);
 
 			/* Now check that all our allocated blocks have the right data */
-			r = *ranges;
-			while(r) {
-				check_index(trace, i, r->index);
-				r = r->next;
-			}
+			check_ranges(*ranges, trace, i);
 		}
+		else if (debug_mode == DBG_WINDOW)
+			mm_checkheap_window(CHECK_WINDOW, verbose);
 
 		switch (trace->ops[i].type) {
 
 			case ALLOC: /* mm_malloc */
+			case MEMALIGN: /* mm_memalign */
 
-				/* Call the student's malloc */
-				if ((p = mm_malloc(size)) == NULL) {
-					malloc_error(trace, i, "mm_malloc failed.");
+				/* Call the student's malloc or memalign */
+				if ((p = mm_alloc_op(&trace->ops[i])) == NULL) {
+					malloc_error(trace, i, "mm_%s failed.",
+							op_names[trace->ops[i].type]);
+					return 0;
+				}
+				align = (size_t)1 << trace->ops[i].arg;
+				if ((size_t)p % align != 0) {
+					malloc_error(trace, i, "Payload address (%p) not aligned "
+							"to the %lu bytes requested", p,
+							(unsigned long)align);
 					return 0;
 				}
 
@@ -865,6 +1429,39 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				mm_free(p);
 				break;
 
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				count = trace->ops[i].arg;
+				if (mm_malloc_batch(size, count,
+							(void **)&trace->blocks[index]) != count) {
+					malloc_error(trace, i, "mm_malloc_batch failed.");
+					return 0;
+				}
+
+				/* Each block of the batch is checked like that of a malloc */
+				for (j = index; j < index + (int)count; j++) {
+					if (add_range(ranges, trace->blocks[j], size, trace, i, j) == 0)
+						return 0;
+					trace->block_sizes[j] = size;
+					randomize_block(trace, j);
+				}
+				break;
+
+			case BATCH_FREE: /* mm_free_batch */
+				count = trace->ops[i].arg;
+				for (j = index; j < index + (int)count; j++) {
+					check_index(trace, i, j);
+					if (trace->block_sizes[j] != size) {
+						malloc_error(trace, i, "free_batch of block %d, which "
+								"holds %lu bytes, as %lu bytes", j,
+								(unsigned long)trace->block_sizes[j],
+								(unsigned long)size);
+						return 0;
+					}
+					remove_range(ranges, trace->blocks[j]);
+				}
+				mm_free_batch((void **)&trace->blocks[index], count, size);
+				break;
+
 			default:
 				app_error("Nonexistent request type in eval_mm_valid");
 		}
@@ -880,38 +1477,48 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size of the heap in bytes while running the student's
+ *   malloc package on the trace. The package can move the brk pointer
+ *   down with mem_shrink(), so the final heap size may be smaller.
+ *   With sample set, the package samples the allocations of the
+ *   replay instead, and its profile is written at the trace's peak of
+ *   live payload. Sampling moves blocks, so that replay is kept apart
+ *   from the one the utilization is taken from.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, int sample)
 {
-	int i;
+	int i, j, count;
 	int index;
 	int size, newsize, oldsize;
 	int max_total_size = 0;
 	int total_size = 0;
+	int peak_op = -1;
 	char *p;
 	char *newp, *oldp;
 
+	/* find the request to write the heap profile after, if sampling */
+	if (sample)
+		trace_peak(trace, &peak_op);
 	reinit_trace(trace);
 
 	/* initialize the heap and the mm malloc package */
 	mem_reset_brk();
 	if (mm_init() < 0)
 		app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+	if (sample)
+		mm_profile_start(HEAP_SAMPLE_BYTES);
 
 	for (i = 0;  i < trace->num_ops;  i++) {
 		switch (trace->ops[i].type) {
 
 			case ALLOC: /* mm_alloc */
+			case MEMALIGN: /* mm_memalign */
 				index = trace->ops[i].index;
 				size = trace->ops[i].size;
 
-				if ((p = mm_malloc(size)) == NULL) {
+				if ((p = mm_alloc_op(&trace->ops[i])) == NULL) {
 					app_error("trace %d: mm_malloc failed in eval_mm_util",
 							tracenum);
 				}
@@ -956,6 +1563,28 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				total_size -= size;
 				break;
 
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				count = trace->ops[i].arg;
+				if (mm_malloc_batch(size, count,
+							(void **)&trace->blocks[index]) != (size_t)count)
+					app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+							tracenum);
+				for (j = index; j < index + count; j++)
+					trace->block_sizes[j] = size;
+				total_size += count * size;
+				break;
+
+			case BATCH_FREE: /* mm_free_batch */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				count = trace->ops[i].arg;
+				mm_free_batch((void **)&trace->blocks[index], count, size);
+				for (j = index; j < index + count; j++)
+					total_size -= trace->block_sizes[j];
+				break;
+
 			default:
 				app_error("trace %d: Nonexistent request type in eval_mm_util",
 						tracenum);
@@ -964,14 +1593,119 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 		/* update the high-water mark */
 		max_total_size = (total_size > max_total_size) ?
 			total_size : max_total_size;
+
+		/* and, if profiling, take a sample of the heap */
+		if (profile_file != NULL && !sample &&
+				((i + 1) % profile_interval == 0 || i + 1 == trace->num_ops))
+			profile_heap(trace, i + 1, total_size);
+		if (i == peak_op)
+			write_heap_sample(tracenum);
 	}
+	if (sample)
+		mm_profile_start(0);
 
 	//printf("max_total_size = %f\n", (double)max_total_size);
 	//printf("mem_heapsize = %f\n", (double)mem_heapsize());
 
-	return ((double)max_total_size / (double)mem_heapsize());
+	return ((double)max_total_size / (double)mem_peak_heapsize());
+}
+
+
+/*
+ * profile_visit - Count one block of the heap into the heapprof_t arg
+ */
+static void profile_visit(void *block, size_t size, int allocated, void *arg)
+{
+	heapprof_t *prof = (heapprof_t *)arg;
+	int bucket;
+
+	(void)block;
+	if (allocated) {
+		prof->alloc_blocks++;
+		return;
+	}
+	prof->free_blocks++;
+	prof->free_bytes += size;
+	prof->largest_free = (size > prof->largest_free) ? size : prof->largest_free;
+	bucket = (size < 32) ? 0 : 63 - __builtin_clzl(size) - 4;
+	bucket = (bucket < PROFILE_BUCKETS) ? bucket : PROFILE_BUCKETS - 1;
+	prof->free_sizes[bucket]++;
+}
+
+/*
+ * profile_heap - Walk the mm heap after request opnum of a trace and
+ *     write a row of the heap profile: the live payload and heap
+ *     bytes, the bytes mapped for huge blocks, the free blocks, the
+ *     external fragmentation (the share of free bytes outside the
+ *     largest free block) and a histogram of the free block sizes.
+ */
+static void profile_heap(const trace_t *trace, int opnum, int live_bytes)
+{
+	heapprof_t prof;
+	int b;
+
+	memset(&prof, 0, sizeof(prof));
+	mm_heapwalk(profile_visit, &prof);
+
+	fprintf(profile_file, "%s,%d,%d,%zu,%zu,%lu,%lu,%zu,%zu,%.4f",
+			trace->filename, opnum, live_bytes, mem_heapsize(),
+			mem_mappedsize(), prof.alloc_blocks, prof.free_blocks,
+			prof.free_bytes, prof.largest_free, (prof.free_bytes == 0) ? 0.0 :
+			1.0 - (double)prof.largest_free / prof.free_bytes);
+	for (b = 0; b < PROFILE_BUCKETS; b++)
+		fprintf(profile_file, ",%lu", prof.free_sizes[b]);
+	fprintf(profile_file, "\n");
+}
+
+/*
+ * write_heap_sample - Write the mm package's sampled heap profile for
+ *     trace tracenum to <sample_prefix>.<tracenum>.heap, for pprof
+ */
+static void write_heap_sample(int tracenum)
+{
+	char filename[MAXLINE];
+	FILE *file;
+
+	snprintf(filename, sizeof(filename), "%s.%04d.heap", sample_prefix, tracenum);
+	if ((file = fopen(filename, "w")) == NULL)
+		unix_error("Could not open %s in write_heap_sample", filename);
+	if (mm_profile_dump(file) < 0)
+		unix_error("Could not write %s in write_heap_sample", filename);
+	fclose(file);
 }
 
+/*
+ * trace_peak - Return the largest number of payload bytes a trace
+ *     has allocated at any one time, and set *peak_op to the first
+ *     request after which it had
+ */
+static size_t trace_peak(trace_t *trace, int *peak_op)
+{
+	int i, j, index, count;
+	size_t live = 0, peak = 0;
+
+	reinit_trace(trace);
+	*peak_op = trace->num_ops - 1;
+	for (i = 0; i < trace->num_ops; i++) {
+		index = trace->ops[i].index;
+		count = (trace->ops[i].type == BATCH_ALLOC ||
+				trace->ops[i].type == BATCH_FREE) ? trace->ops[i].arg : 1;
+		for (j = index; j < index + count && j >= 0; j++) {
+			live -= trace->block_sizes[j];
+			trace->block_sizes[j] = 0;
+			if (trace->ops[i].type != FREE && trace->ops[i].type != BATCH_FREE) {
+				live += trace->ops[i].size;
+				trace->block_sizes[j] = trace->ops[i].size;
+			}
+		}
+		if (live > peak) {
+			peak = live;
+			*peak_op = i;
+		}
+	}
+	reinit_trace(trace);
+	return peak;
+}
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
@@ -979,7 +1713,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-	int i, index, size, newsize;
+	int i, index, newsize;
 	char *p, *newp, *oldp, *block;
 	trace_t *trace = ((speed_t *)ptr)->trace;
 	reinit_trace(trace);
@@ -994,9 +1728,9 @@ static void eval_mm_speed(void *ptr)
 		switch (trace->ops[i].type) {
 
 			case ALLOC: /* mm_malloc */
+			case MEMALIGN: /* mm_memalign */
 				index = trace->ops[i].index;
-				size = trace->ops[i].size;
-				if ((p = mm_malloc(size)) == NULL)
+				if ((p = mm_alloc_op(&trace->ops[i])) == NULL)
 					app_error("mm_malloc error in eval_mm_speed");
 				trace->blocks[index] = p;
 				break;
@@ -1020,11 +1754,35 @@ static void eval_mm_speed(void *ptr)
 				mm_free(block);
 				break;
 
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				index = trace->ops[i].index;
+				if (mm_malloc_batch(trace->ops[i].size, trace->ops[i].arg,
+							(void **)&trace->blocks[index]) != trace->ops[i].arg)
+					app_error("mm_malloc_batch error in eval_mm_speed");
+				break;
+
+			case BATCH_FREE: /* mm_free_batch */
+				index = trace->ops[i].index;
+				mm_free_batch((void **)&trace->blocks[index], trace->ops[i].arg,
+						trace->ops[i].size);
+				break;
+
 			default:
 				app_error("Nonexistent request type in eval_mm_speed");
 		}
 }
 
+/*
+ * libc_alloc_op - Run an alloc request of a trace through libc:
+ *     malloc, or aligned_alloc for a MEMALIGN request
+ */
+static void *libc_alloc_op(const traceop_t *op)
+{
+	if (op->type == MEMALIGN)
+		return aligned_alloc((size_t)1 << op->arg, op->size);
+	return malloc(op->size);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1033,7 +1791,7 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace)
 {
-	int i, newsize;
+	int i, j, newsize;
 	char *p, *newp, *oldp;
 
 	reinit_trace(trace);
@@ -1042,7 +1800,8 @@ static int eval_libc_valid(trace_t *trace)
 		switch (trace->ops[i].type) {
 
 			case ALLOC: /* malloc */
-				if ((p = malloc(trace->ops[i].size)) == NULL) {
+			case MEMALIGN: /* aligned_alloc */
+				if ((p = libc_alloc_op(&trace->ops[i])) == NULL) {
 					malloc_error(trace, i, "libc malloc failed");
 					unix_error("System message");
 				}
@@ -1067,6 +1826,21 @@ static int eval_libc_valid(trace_t *trace)
 				}
 				break;
 
+			case BATCH_ALLOC: /* malloc, once per block */
+				for (j = 0; j < trace->ops[i].arg; j++) {
+					if ((p = malloc(trace->ops[i].size)) == NULL) {
+						malloc_error(trace, i, "libc malloc failed");
+						unix_error("System message");
+					}
+					trace->blocks[trace->ops[i].index + j] = p;
+				}
+				break;
+
+			case BATCH_FREE: /* free, once per block */
+				for (j = 0; j < trace->ops[i].arg; j++)
+					free(trace->blocks[trace->ops[i].index + j]);
+				break;
+
 			default:
 				app_error("invalid operation type  in eval_libc_valid");
 		}
@@ -1082,8 +1856,8 @@ static int eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-	int i;
-	int index, size, newsize;
+	int i, j;
+	int index, newsize;
 	char *p, *newp, *oldp, *block;
 	trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -1092,9 +1866,9 @@ static void eval_libc_speed(void *ptr)
 	for (i = 0;  i < trace->num_ops;  i++) {
 		switch (trace->ops[i].type) {
 			case ALLOC: /* malloc */
+			case MEMALIGN: /* aligned_alloc */
 				index = trace->ops[i].index;
-				size = trace->ops[i].size;
-				if ((p = malloc(size)) == NULL)
+				if ((p = libc_alloc_op(&trace->ops[i])) == NULL)
 					unix_error("malloc failed in eval_libc_speed");
 				trace->blocks[index] = p;
 				break;
@@ -1118,10 +1892,783 @@ static void eval_libc_speed(void *ptr)
 					free(0);
 				}
 				break;
+
+			case BATCH_ALLOC: /* malloc, once per block */
+				index = trace->ops[i].index;
+				for (j = 0; j < trace->ops[i].arg; j++)
+					if ((trace->blocks[index + j] = malloc(trace->ops[i].size)) == NULL)
+						unix_error("malloc failed in eval_libc_speed");
+				break;
+
+			case BATCH_FREE: /* free, once per block */
+				index = trace->ops[i].index;
+				for (j = 0; j < trace->ops[i].arg; j++)
+					free(trace->blocks[index + j]);
+				break;
 		}
 	}
 }
 
+/*****************************************************************
+ * The following routines time every request of the mm malloc
+ * package with the cycle counter, and keep log-bucketed histograms
+ * of the latencies, so that the slow tail of the requests shows up
+ * and not just their total running time.
+ ****************************************************************/
+
+/*
+ * eval_mm_latency - Replay a trace LAT_PASSES times on a fresh heap,
+ *     timing each request on its own
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *lat)
+{
+	int i, pass, index;
+	size_t size, count;
+	char *p, *block;
+	double cycles;
+
+	for (pass = 0; pass < LAT_PASSES; pass++) {
+		reinit_trace(trace);
+
+		/* Reset the heap and initialize the mm package */
+		mem_reset_brk();
+		if (mm_init() < 0)
+			app_error("mm_init failed in eval_mm_latency");
+
+		/* Interpret each trace request */
+		for (i = 0;  i < trace->num_ops;  i++) {
+			index = trace->ops[i].index;
+			size = trace->ops[i].size;
+			switch (trace->ops[i].type) {
+
+				case ALLOC: /* mm_malloc */
+				case MEMALIGN: /* mm_memalign */
+					start_counter();
+					p = mm_alloc_op(&trace->ops[i]);
+					cycles = get_counter();
+					if (p == NULL)
+						app_error("mm_malloc error in eval_mm_latency");
+					trace->blocks[index] = p;
+					break;
+
+				case REALLOC: /* mm_realloc */
+					block = trace->blocks[index];
+					start_counter();
+					p = mm_realloc(block, size);
+					cycles = get_counter();
+					if (p == NULL && size != 0)
+						app_error("mm_realloc error in eval_mm_latency");
+					trace->blocks[index] = p;
+					break;
+
+				case FREE: /* mm_free */
+					block = (index < 0) ? NULL : trace->blocks[index];
+					start_counter();
+					mm_free(block);
+					cycles = get_counter();
+					break;
+
+				case BATCH_ALLOC: /* mm_malloc_batch */
+					start_counter();
+					count = mm_malloc_batch(size, trace->ops[i].arg,
+							(void **)&trace->blocks[index]);
+					cycles = get_counter();
+					if (count != trace->ops[i].arg)
+						app_error("mm_malloc_batch error in eval_mm_latency");
+					break;
+
+				case BATCH_FREE: /* mm_free_batch */
+					start_counter();
+					mm_free_batch((void **)&trace->blocks[index],
+							trace->ops[i].arg, size);
+					cycles = get_counter();
+					break;
+
+				default:
+					app_error("Nonexistent request type in eval_mm_latency");
+			}
+			lat_record(lat, trace->ops[i].type, cycles);
+		}
+	}
+}
+
+/*
+ * counter_overhead - Return the fewest cycles the counter reports
+ *     around no work at all, which lat_record takes off every sample
+ */
+static double counter_overhead(void)
+{
+	static double overhead = -1;
+	double cycles;
+	int i;
+
+	if (overhead < 0) {
+		overhead = DBL_MAX;
+		for (i = 0; i < 1000; i++) {
+			start_counter();
+			cycles = get_counter();
+			overhead = (cycles < overhead) ? cycles : overhead;
+		}
+	}
+	return overhead;
+}
+
+/*
+ * lat_record - Count one request of the given type that took the
+ *     given cycles. Below 2 * LAT_SUB cycles every count has its own
+ *     bucket; above, each power of two is split into LAT_SUB buckets.
+ */
+static void lat_record(latency_t *lat, int type, double cycles)
+{
+	unsigned long c;
+	int msb, bucket;
+
+	cycles -= counter_overhead();
+	cycles = (cycles < 0) ? 0 : cycles;
+	c = (unsigned long)cycles;
+
+	if (c < LAT_SUB) {
+		bucket = c;
+	} else {
+		msb = 63 - __builtin_clzl(c);
+		bucket = (msb - LAT_SUB_BITS + 1) * LAT_SUB +
+			((c >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+	}
+	lat->counts[type][bucket]++;
+	lat->n[type]++;
+	lat->max[type] = (cycles > lat->max[type]) ? cycles : lat->max[type];
+}
+
+/*
+ * lat_bucket_lo - Return the fewest cycles counted in a bucket
+ */
+static double lat_bucket_lo(int bucket)
+{
+	int shift;
+
+	if (bucket < LAT_SUB)
+		return bucket;
+	shift = bucket / LAT_SUB - 1;
+	return (double)(LAT_SUB + bucket % LAT_SUB) * (double)(1UL << shift);
+}
+
+/*
+ * lat_bucket_hi - Return the most cycles counted in a bucket
+ */
+static double lat_bucket_hi(int bucket)
+{
+	return lat_bucket_lo(bucket + 1) - 1;
+}
+
+/*
+ * lat_percentile - Return the latency that a fraction p of the
+ *     requests of a type did not exceed, to within its bucket
+ */
+static double lat_percentile(const latency_t *lat, int type, double p)
+{
+	unsigned long seen = 0, target;
+	double hi;
+	int b;
+
+	if (lat->n[type] == 0)
+		return 0;
+	target = (unsigned long)(p * lat->n[type]);
+	target += (target < p * lat->n[type] || target == 0);
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		seen += lat->counts[type][b];
+		if (seen >= target)
+			break;
+	}
+	hi = lat_bucket_hi(b);
+	return (hi < lat->max[type]) ? hi : lat->max[type];
+}
+
+/*
+ * print_latency - Print the p50, p99, p99.9 and max latencies of each
+ *     request type over each trace in a compact table
+ */
+static void print_latency(int n, stats_t *stats, latency_t *lat)
+{
+	int i, type;
+
+	printf("%13s%10s%8s%8s%8s%10s  %s\n",
+			"op", "count", "p50", "p99", "p99.9", "max", "trace");
+	for (i = 0; i < n; i++) {
+		for (type = ALLOC; type < NUM_OP_TYPES; type++) {
+			if (lat[i].n[type] == 0)
+				continue;
+			printf("%13s%10lu%8.0f%8.0f%8.0f%10.0f  %s\n",
+					op_names[type], lat[i].n[type],
+					lat_percentile(&lat[i], type, 0.50),
+					lat_percentile(&lat[i], type, 0.99),
+					lat_percentile(&lat[i], type, 0.999),
+					lat[i].max[type], stats[i].filename);
+		}
+	}
+}
+
+/*
+ * write_latency_csv - Write every non-empty bucket of the latency
+ *     histograms to a CSV file, one row per trace, op type and bucket
+ */
+static void write_latency_csv(const char *filename, int n, stats_t *stats,
+		latency_t *lat)
+{
+	FILE *fp;
+	int i, type, b;
+
+	if ((fp = fopen(filename, "w")) == NULL)
+		unix_error("Could not open %s in write_latency_csv", filename);
+	fprintf(fp, "trace,op,lo_cycles,hi_cycles,count\n");
+	for (i = 0; i < n; i++)
+		for (type = ALLOC; type < NUM_OP_TYPES; type++)
+			for (b = 0; b < LAT_BUCKETS; b++)
+				if (lat[i].counts[type][b] != 0)
+					fprintf(fp, "%s,%s,%.0f,%.0f,%lu\n",
+							stats[i].filename, op_names[type],
+							lat_bucket_lo(b), lat_bucket_hi(b),
+							lat[i].counts[type][b]);
+	fclose(fp);
+}
+
+/*****************************************************************
+ * The following routines time each trace, save the results to a
+ * JSON or CSV file, and compare them with the results saved by an
+ * earlier run, to track regressions in speed and utilization.
+ ****************************************************************/
+
+/*
+ * measure_speed - Time f(argp) speed_runs times with fsecs, and keep
+ *     the mean and standard deviation of the runs in stats, with the
+ *     number and variance of the samples that fcyc took
+ */
+static void measure_speed(stats_t *stats, fsecs_test_funct f, void *argp)
+{
+	int i, samples;
+	double secs, var, sum = 0, sumsq = 0;
+
+	stats->samples = 0;
+	stats->secs_var = 0;
+	for (i = 0; i < speed_runs; i++) {
+		secs = fsecs(f, argp);
+		fsecs_stats(&samples, &var);
+		sum += secs;
+		sumsq += secs * secs;
+		stats->samples += samples;
+		stats->secs_var += var / speed_runs;
+	}
+	stats->runs = speed_runs;
+	stats->secs = sum / speed_runs;
+	stats->secs_sd = 0;
+	if (speed_runs > 1 && sumsq > sum * stats->secs)
+		stats->secs_sd = sqrt((sumsq - sum * stats->secs) / (speed_runs - 1));
+}
+
+/*
+ * check_result_names - Exit before any trace is run if one of the n
+ *     trace paths could not be written as is by write_results: a
+ *     quote or backslash would break the JSON, a comma the CSV
+ */
+static void check_result_names(int n, const char *tracedir, char **tracefiles)
+{
+	char path[MAXLINE];
+	const char *c;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s%s", tracedir, tracefiles[i]);
+		for (c = path; *c != '\0'; c++)
+			if (*c == '"' || *c == '\\' || *c == ',' ||
+					(unsigned char)*c < ' ')
+				app_error("-o cannot save the results of trace %s: "
+						"its path holds a quote, backslash, comma or "
+						"control character\n", path);
+	}
+}
+
+/*
+ * write_results - Write the results of every trace to filename: as
+ *     JSON, with one trace per line, if it ends in .json, and
+ *     otherwise as CSV
+ */
+static void write_results(const char *filename, int n, stats_t *stats,
+		double perfindex)
+{
+	FILE *fp;
+	size_t len = strlen(filename);
+	int i, json = len >= 5 && strcmp(filename + len - 5, ".json") == 0;
+	double kops;
+
+	if ((fp = fopen(filename, "w")) == NULL)
+		unix_error("Could not open %s in write_results", filename);
+	if (json)
+		fprintf(fp, "{\"fcyc_k\": %d, \"fcyc_epsilon\": %g, \"perf_index\": %.1f, "
+				"\"traces\": [\n", get_fcyc_k(), get_fcyc_epsilon(), perfindex);
+	else
+		fprintf(fp, "trace,valid,weight,ops,secs,kops,util,runs,secs_sd,"
+				"samples,secs_var\n");
+	for (i = 0; i < n; i++) {
+		kops = (stats[i].valid && stats[i].secs > 0) ?
+			stats[i].ops / 1e3 / stats[i].secs : 0;
+		fprintf(fp, json ? "  {\"trace\": \"%s\", \"valid\": %d, \"weight\": %d, "
+				"\"ops\": %.0f, \"secs\": %.9g, \"kops\": %.1f, \"util\": %.6f, "
+				"\"runs\": %d, \"secs_sd\": %.9g, \"samples\": %d, "
+				"\"secs_var\": %.9g}%s\n" :
+				"%s,%d,%d,%.0f,%.9g,%.1f,%.6f,%d,%.9g,%d,%.9g%s\n",
+				stats[i].filename, stats[i].valid, stats[i].weight,
+				stats[i].ops, stats[i].secs, kops, stats[i].util,
+				stats[i].runs, stats[i].secs_sd, stats[i].samples,
+				stats[i].secs_var, (json && i < n - 1) ? "," : "");
+	}
+	if (json)
+		fprintf(fp, "]}\n");
+	fclose(fp);
+}
+
+/*
+ * read_results - Read back the results that write_results wrote to
+ *     filename, in either format; sets *n to the number of traces
+ */
+static stats_t *read_results(const char *filename, int *n)
+{
+	FILE *fp;
+	char line[4 * MAXLINE];
+	stats_t *stats = NULL, s;
+	int max = 0;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		unix_error("Could not open %s in read_results", filename);
+	*n = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		memset(&s, 0, sizeof(s));
+		if (sscanf(line, " {\"trace\": \"%1023[^\"]\", \"valid\": %d, "
+					"\"weight\": %d, \"ops\": %lf, \"secs\": %lf, \"kops\": %*f, "
+					"\"util\": %lf, \"runs\": %d, \"secs_sd\": %lf, "
+					"\"samples\": %d, \"secs_var\": %lf", s.filename, &s.valid,
+					&s.weight, &s.ops, &s.secs, &s.util, &s.runs, &s.secs_sd,
+					&s.samples, &s.secs_var) != 10 &&
+				sscanf(line, "%1023[^,],%d,%d,%lf,%lf,%*f,%lf,%d,%lf,%d,%lf",
+					s.filename, &s.valid, &s.weight, &s.ops, &s.secs, &s.util,
+					&s.runs, &s.secs_sd, &s.samples, &s.secs_var) != 10) {
+			/* the CSV header, or the lines around the JSON traces */
+			if (strncmp(line, "trace,", 6) == 0 ||
+					strncmp(line, "{\"fcyc_k\"", 9) == 0 ||
+					strncmp(line, "]}", 2) == 0)
+				continue;
+			app_error("%s: cannot read the results line \"%.*s\"\n", filename,
+					(int)strcspn(line, "\n"), line);
+		}
+		if (*n == max) {
+			max = (max == 0) ? 16 : 2 * max;
+			if ((stats = realloc(stats, max * sizeof(stats_t))) == NULL)
+				unix_error("realloc failed in read_results");
+		}
+		stats[(*n)++] = s;
+	}
+	fclose(fp);
+	if (*n == 0)
+		app_error("%s holds no results", filename);
+	return stats;
+}
+
+/*
+ * compare_results - Compare the results of every trace with those
+ *     saved to filename, and return how many got worse. A trace is
+ *     slower if its mean time is longer by more than the tolerance of
+ *     the K best times, and by more than REGRESSION_T standard errors
+ *     (Welch's t, from the spread of the runs). With fewer than two
+ *     runs on either side there is no spread to test, and a trace is
+ *     slower if its time grew by more than the tolerance alone. It is
+ *     less efficient if its utilization has dropped by more than
+ *     UTIL_TOLERANCE.
+ */
+static int compare_results(int n, stats_t *stats, const char *filename)
+{
+	stats_t *base, *b;
+	int i, j, num_base, tested, untested = 0, regressions = 0;
+	double change, se, t;
+	char tstr[32];
+	const char *verdict;
+
+	base = read_results(filename, &num_base);
+	printf("\nCompared with %s:\n", filename);
+	printf("%7s%7s%9s%9s%8s%7s  %s\n",
+			"util", "base", "Kops", "base", "change", "t", "trace");
+	for (i = 0; i < n; i++) {
+		for (j = 0, b = NULL; j < num_base && b == NULL; j++)
+			if (strcmp(base[j].filename, stats[i].filename) == 0)
+				b = &base[j];
+		if (b == NULL || !b->valid || !stats[i].valid || b->secs <= 0 ||
+				stats[i].secs <= 0) {
+			printf("%7s%7s%9s%9s%8s%7s  %s%s\n", "-", "-", "-", "-", "-", "-",
+					stats[i].filename, (b == NULL) ? " (not in baseline)" : "");
+			continue;
+		}
+
+		change = b->secs / stats[i].secs - 1;  /* in throughput */
+		t = se = 0;
+		strcpy(tstr, "-");
+		tested = stats[i].runs > 1 && b->runs > 1;
+		if (tested) {
+			se = sqrt(stats[i].secs_sd * stats[i].secs_sd / stats[i].runs +
+					b->secs_sd * b->secs_sd / b->runs);
+			if (se > 0) {
+				t = (stats[i].secs - b->secs) / se;
+				sprintf(tstr, "%.1f", t);
+			}
+		} else
+			untested++;
+
+		verdict = "";
+		if (stats[i].util < b->util - UTIL_TOLERANCE) {
+			verdict = " (less efficient)";
+			regressions++;
+		} else if (stats[i].secs > b->secs * (1 + get_fcyc_epsilon()) &&
+				(!tested || se == 0 || t > REGRESSION_T)) {
+			verdict = " (slower)";
+			regressions++;
+		} else if (stats[i].secs < b->secs * (1 - get_fcyc_epsilon()) &&
+				(!tested || se == 0 || t < -REGRESSION_T))
+			verdict = " (faster)";
+
+		printf("%6.1f%%%6.1f%%%9.0f%9.0f%+7.1f%%%7s  %s%s\n",
+				stats[i].util * 100, b->util * 100,
+				stats[i].ops / 1e3 / stats[i].secs, b->ops / 1e3 / b->secs,
+				change * 100, tstr, stats[i].filename, verdict);
+	}
+	if (untested > 0)
+		printf("%d traces have fewer than 2 runs here or in the baseline, so "
+				"their times\nare only compared to within the tolerance %g "
+				"(no t test); use -r\n", untested, get_fcyc_epsilon());
+	if (regressions > 0)
+		printf("%d of %d traces regressed\n", regressions, n);
+	else
+		printf("No regressions\n");
+	free(base);
+	return regressions;
+}
+
+/*****************************************************************
+ * The following routines replay the traces on several threads at
+ * once, to measure how the mm malloc package scales. They need the
+ * thread-safe build of the package, so they are only compiled into
+ * mdriver-ts.
+ ****************************************************************/
+
+#ifdef THREAD_SAFE
+/*
+ * run_parallel_tests - Replay all traces on 1, 2, 4, ... and finally
+ *     max_threads threads at once, each thread with its own copy of
+ *     every trace, and report the throughput and the scaling
+ *     efficiency at each thread count. With split, thread i of k
+ *     replays only traces i, i + k, ..., so that the traces mmrecord
+ *     writes for each thread of a program replay as they were recorded
+ *     once there are as many threads as traces.
+ */
+static void run_parallel_tests(int num_tracefiles, const char *tracedir,
+		char **tracefiles, int max_threads, int producer_consumer, int split)
+{
+	int i, j, k, peak_op;
+	size_t peak, split_peak = 0;
+	stats_t stats;
+	trace_t **traces;
+	parallel_t params;
+	double ops = 0, secs, rate, base_rate = 0;
+
+	if (verbose > 1)
+		printf("Reading traces for the parallel replay\n");
+	if ((traces = calloc(num_tracefiles, sizeof(trace_t *))) == NULL)
+		unix_error("calloc 1 failed in run_parallel_tests");
+	/*
+	 * Every thread shares the one simulated heap, so leave out the
+	 * traces whose peak footprint would not fit max_threads times, or,
+	 * split, together with the traces before them
+	 */
+	for (i = j = 0; i < num_tracefiles; i++) {
+		traces[j] = read_trace(&stats, tracedir, tracefiles[i]);
+		peak = trace_peak(traces[j], &peak_op);
+		if ((split ? split_peak + peak : max_threads * peak) > MAX_HEAP / 2) {
+			printf("Leaving %s out of the parallel replay: too large for "
+					"%d threads\n", tracefiles[i], max_threads);
+			free_trace(traces[j]);
+			continue;
+		}
+		split_peak += peak;
+		ops += traces[j++]->num_ops;
+	}
+	num_tracefiles = j;
+	if (num_tracefiles == 0)
+		app_error("No trace fits the parallel replay");
+	if (split && max_threads > num_tracefiles)
+		max_threads = num_tracefiles;
+	ops *= PAR_PASSES;
+
+	params.replays = calloc(max_threads, sizeof(replay_t));
+	params.tids = calloc(max_threads, sizeof(pthread_t));
+	params.handoffs = NULL;
+	if (producer_consumer)
+		params.handoffs = calloc(max_threads, sizeof(handoff_t));
+	if (params.replays == NULL || params.tids == NULL ||
+			(producer_consumer && params.handoffs == NULL))
+		unix_error("calloc 2 failed in run_parallel_tests");
+	for (i = 0; i < max_threads; i++) {
+		params.replays[i].num_traces = num_tracefiles;
+		if ((params.replays[i].traces =
+					calloc(num_tracefiles, sizeof(trace_t *))) == NULL)
+			unix_error("calloc 3 failed in run_parallel_tests");
+		for (j = 0; j < num_tracefiles; j++)
+			params.replays[i].traces[j] = copy_trace(traces[j]);
+	}
+
+	printf("\nParallel replay of %d traces, %d passes per thread%s%s:\n",
+			num_tracefiles, PAR_PASSES,
+			split ? ", shared out over the threads" : "",
+			producer_consumer ? ", freed by the next thread" : "");
+	printf("%8s%10s%9s%12s\n", "threads", "Kops", "speedup", "efficiency");
+	for (k = 1; k <= max_threads;
+			k = (k < max_threads && 2 * k > max_threads) ? max_threads : 2 * k) {
+		/* In producer/consumer mode thread i passes its frees to thread i+1 */
+		params.num_threads = k;
+		for (i = 0; i < k; i++) {
+			params.replays[i].first = split ? i : 0;
+			params.replays[i].step = split ? k : 1;
+			params.replays[i].in = NULL;
+			params.replays[i].out = NULL;
+			if (producer_consumer) {
+				params.replays[i].in = &params.handoffs[i];
+				params.replays[i].out = &params.handoffs[(i + 1) % k];
+			}
+		}
+
+		secs = DBL_MAX;
+		for (j = 0; j < PAR_RUNS; j++) {
+			double run_secs = ftimer_gettod(eval_mm_parallel, &params, 1);
+			secs = (run_secs < secs) ? run_secs : secs;
+		}
+		rate = (split ? 1 : k) * ops / secs;
+		if (k == 1)
+			base_rate = rate;
+		printf("%8d%10.0f%8.2fx%11.0f%%\n", k, rate / 1e3,
+				rate / base_rate, 100.0 * rate / (k * base_rate));
+	}
+
+	for (i = 0; i < max_threads; i++) {
+		for (j = 0; j < num_tracefiles; j++)
+			free_trace(params.replays[i].traces[j]);
+		free(params.replays[i].traces);
+	}
+	for (i = 0; i < num_tracefiles; i++)
+		free_trace(traces[i]);
+	free(traces);
+	free(params.replays);
+	free(params.tids);
+	free(params.handoffs);
+}
+
+/*
+ * copy_trace - Make a replay thread's own copy of a trace record and
+ *     of the arrays it points to
+ */
+static trace_t *copy_trace(const trace_t *trace)
+{
+	trace_t *copy;
+
+	if ((copy = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+		unix_error("malloc 1 failed in copy_trace");
+	*copy = *trace;
+	copy->map = NULL;
+	if ((copy->ops =
+				(traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+		unix_error("malloc 2 failed in copy_trace");
+	memcpy(copy->ops, trace->ops, trace->num_ops * sizeof(traceop_t));
+	if ((copy->blocks =
+				(char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+		unix_error("malloc 3 failed in copy_trace");
+	if ((copy->block_sizes =
+				(size_t *)calloc(trace->num_ids, sizeof(size_t))) == NULL)
+		unix_error("malloc 4 failed in copy_trace");
+	if ((copy->block_rand_base =
+				calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+		unix_error("malloc 5 failed in copy_trace");
+	return copy;
+}
+
+/*
+ * handoff_put - Pass p on through q; returns 0 if q is full
+ */
+static int handoff_put(handoff_t *q, void *p)
+{
+	unsigned tail = q->tail;
+
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == HANDOFF_LEN)
+		return 0;
+	q->slots[tail % HANDOFF_LEN] = p;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * handoff_get - Take the oldest pointer passed through q, or NULL if
+ *     there is none
+ */
+static void *handoff_get(handoff_t *q)
+{
+	unsigned head = q->head;
+	void *p;
+
+	if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	p = q->slots[head % HANDOFF_LEN];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+/*
+ * replay_free - Free p, or pass it to the next thread when out is set.
+ *     While out is full, the frees passed to this thread are done, so
+ *     that a ring of threads can never all wait on each other.
+ */
+static void replay_free(void *p, handoff_t *out, handoff_t *in)
+{
+	void *q;
+
+	if (out == NULL) {
+		mm_free(p);
+		return;
+	}
+	while (!handoff_put(out, p)) {
+		while ((q = handoff_get(in)) != NULL)
+			mm_free(q);
+		sched_yield();
+	}
+}
+
+/*
+ * replay_trace - Run every request of a trace through the mm package.
+ *     Blocks the trace leaves allocated are freed at the end, so that
+ *     it can be replayed again on the same heap.
+ */
+static void replay_trace(trace_t *trace, handoff_t *out, handoff_t *in)
+{
+	int i, j, index;
+	size_t size;
+	char *p;
+
+	reinit_trace(trace);
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		size = trace->ops[i].size;
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* mm_malloc */
+			case MEMALIGN: /* mm_memalign */
+				if ((p = mm_alloc_op(&trace->ops[i])) == NULL)
+					app_error("mm_malloc error in replay_trace");
+				trace->blocks[index] = p;
+				break;
+
+			case REALLOC: /* mm_realloc */
+				p = mm_realloc(trace->blocks[index], size);
+				if (p == NULL && size != 0)
+					app_error("mm_realloc error in replay_trace");
+				trace->blocks[index] = p;
+				break;
+
+			case FREE: /* mm_free */
+				if (index < 0) {
+					mm_free(0);
+				} else {
+					replay_free(trace->blocks[index], out, in);
+					trace->blocks[index] = NULL;
+				}
+				break;
+
+			case BATCH_ALLOC: /* mm_malloc_batch */
+				if (mm_malloc_batch(size, trace->ops[i].arg,
+							(void **)&trace->blocks[index]) != trace->ops[i].arg)
+					app_error("mm_malloc_batch error in replay_trace");
+				break;
+
+			case BATCH_FREE: /* mm_free_batch, or one handoff per block */
+				if (out == NULL)
+					mm_free_batch((void **)&trace->blocks[index],
+							trace->ops[i].arg, size);
+				else
+					for (j = index; j < index + trace->ops[i].arg; j++)
+						replay_free(trace->blocks[j], out, in);
+				for (j = index; j < index + trace->ops[i].arg; j++)
+					trace->blocks[j] = NULL;
+				break;
+
+			default:
+				app_error("Nonexistent request type in replay_trace");
+		}
+
+		/* Free what the previous thread has passed on so far */
+		if (in != NULL)
+			while ((p = handoff_get(in)) != NULL)
+				mm_free(p);
+	}
+	for (index = 0; index < trace->num_ids; index++)
+		if (trace->blocks[index] != NULL)
+			replay_free(trace->blocks[index], out, in);
+}
+
+/*
+ * replay_thread - Body of each thread of eval_mm_parallel: replay the
+ *    thread's share of its traces PAR_PASSES times, then keep freeing what the
+ *    previous thread passes on until it is done as well.
+ */
+static void *replay_thread(void *ptr)
+{
+	replay_t *replay = (replay_t *)ptr;
+	void *p;
+	int i, j, done;
+
+	for (i = 0; i < PAR_PASSES; i++)
+		for (j = replay->first; j < replay->num_traces; j += replay->step)
+			replay_trace(replay->traces[j], replay->out, replay->in);
+
+	if (replay->out != NULL) {
+		__atomic_store_n(&replay->out->done, 1, __ATOMIC_RELEASE);
+		do {
+			done = __atomic_load_n(&replay->in->done, __ATOMIC_ACQUIRE);
+			while ((p = handoff_get(replay->in)) != NULL)
+				mm_free(p);
+			if (!done)
+				sched_yield();
+		} while (!done);
+	}
+	return NULL;
+}
+
+/*
+ * eval_mm_parallel - This is the function that is used by ftimer to
+ *    measure the running time of the mm malloc package while
+ *    num_threads threads replay the traces at once.
+ */
+
+static void eval_mm_parallel(void *ptr)
+{
+	parallel_t *params = (parallel_t *)ptr;
+	int i;
+
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_parallel");
+	if (params->handoffs != NULL)
+		memset(params->handoffs, 0, params->num_threads * sizeof(handoff_t));
+
+	for (i = 0; i < params->num_threads; i++)
+		if ((errno = pthread_create(&params->tids[i], NULL, replay_thread,
+						&params->replays[i])) != 0)
+			unix_error("pthread_create failed in eval_mm_parallel");
+	for (i = 0; i < params->num_threads; i++)
+		pthread_join(params->tids[i], NULL);
+}
+#endif
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1235,14 +2782,37 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 static void usage(void)
 {
 	fprintf(stderr,
-		"Usage: mdriver [-hlD] [-d <i>] [-t <dir>] [-c <file>] [-f <file>]\n"
+		"Usage: mdriver [-hlLpsD] [-d <i>] [-t <dir>] [-c <file>] [-f <file>]...\n"
+		"               [-H <file>] [-P <file> [-i <n>]] [-S <prefix>] [-T <n>]\n"
+		"               [-o <file>] [-b <file>] [-r <n>] [-K <k>] [-E <eps>]\n"
 		"Options\n"
-		"\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n"
+		"\t-d <i>     Debug: 0 off; 1 default; 2 lots; 3 a window of blocks\n"
+		"\t           per request; 4 the blocks each request touches.\n"
 		"\t-D         Equivalent to -d2.\n"
 		"\t-c <file>  Run trace file <file> once, check for correctness only.\n"
 		"\t-t <dir>   Directory to find default traces.\n"
 		"\t-h         Print this message.\n"
 		"\t-l         Run libc malloc as well.\n"
-		"\t-f <file>  Use <file> as the trace file.\n"
+		"\t-f <file>  Use <file> as a trace file; -f can be given again.\n"
+		"\t-L         Time every request and report tail latencies.\n"
+		"\t-H <file>  Like -L, and write the latency histograms to CSV <file>.\n"
+		"\t-P <file>  Write a profile of the heap over time to CSV <file>.\n"
+		"\t-i <n>     With -P, sample the heap every <n> requests (default 100).\n"
+		"\t-S <prefix> Write a pprof heap profile of trace <n> at its peak\n"
+		"\t           to <prefix>.<n>.heap.\n"
+		"\t-T <n>     Also replay the traces on up to <n> threads (mdriver-ts).\n"
+		"\t-p         With -T, free each block on the next thread.\n"
+		"\t-s         With -T, share the traces out: thread i of k replays\n"
+		"\t           traces i, i + k, ..., as for the traces of mmrecord.\n"
+		"\t-o <file>  Write the results to <file>, as JSON if it ends in\n"
+		"\t           .json and otherwise as CSV.\n"
+		"\t-b <file>  Compare the results with those -o wrote to <file>, and\n"
+		"\t           exit with status 1 if any trace got worse.\n"
+		"\t-r <n>     Measure the speed of each trace <n> times (default 1).\n"
+		"\t           With -b, times are t tested only if both sides had\n"
+		"\t           -r 2 or more, and otherwise compared to within -E.\n"
+		"\t-K <k>     Time each measurement until its <k> best runs agree\n"
+		"\t           (default 10)...\n"
+		"\t-E <eps>   ...to within a fraction <eps> (default 0.01).\n"
 	);
 }
@@ -2,7 +2,15 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            Built with REAL_MEMORY, for the package standing in for libc's
+ *            malloc in real programs, the heap is real memory instead: its
+ *            MAX_HEAP bytes of address space are only reserved, at the first
+ *            call, and made accessible as the brk and the mapped regions grow
+ *            into them. The mappings of mem_mmap then go unrecorded, since the
+ *            records would have to be malloced.
  */
+#define _GNU_SOURCE            /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -19,7 +27,79 @@
 static unsigned char *heap;
 static unsigned char *mem_brk;
 static unsigned char *mem_max_addr;
+static unsigned char *mem_map_lo;  /* lowest region handed out by mem_map */
+static unsigned char *mem_zero_mark; /* every heap byte from here up is zero */
+static char mem_lock;              /* serializes moves of mem_brk and mem_map_lo */
+static size_t mem_mapped;          /* bytes in mappings from mem_mmap */
+static size_t mem_peak;            /* largest heap size plus mem_mapped so far */
+#ifdef REAL_MEMORY
+static unsigned char *mem_open_hi; /* end of the accessible pages above heap */
+#endif
 
+/* A mapping from mem_mmap, kept so that mem_is_mapped can find it */
+typedef struct mapping {
+    void *lo;
+    size_t size;
+    struct mapping *next;
+} mapping_t;
+static mapping_t *mem_mappings;
+
+static void mem_acquire(void)
+{
+    while (__atomic_test_and_set(&mem_lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void mem_release(void)
+{
+    __atomic_clear(&mem_lock, __ATOMIC_RELEASE);
+}
+
+#ifdef REAL_MEMORY
+/*
+ * mem_reserve - reserves the address space of the heap, unless that is
+ *    done already, so that the first call of any function can make it.
+ *    Called with mem_lock held. Returns -1 if it could not be reserved.
+ */
+static int mem_reserve(void)
+{
+    void *reserved;
+
+    if (heap != NULL)
+        return 0;
+    reserved = mmap(NULL, MAX_HEAP, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED)
+        return -1;
+    heap = reserved;
+    mem_max_addr = heap + MAX_HEAP;
+    mem_brk = heap;
+    mem_map_lo = mem_max_addr;
+    mem_zero_mark = heap;
+    mem_open_hi = heap;
+    return 0;
+}
+
+/*
+ * mem_open - makes the pages of the len bytes at lo accessible. Returns
+ *    -1 if they could not be.
+ */
+static int mem_open(void *lo, size_t len)
+{
+    return mprotect(lo, len, PROT_READ | PROT_WRITE);
+}
+
+/*
+ * mem_init - reserves the heap, which the other functions also do at
+ *    their first call
+ */
+void mem_init(void)
+{
+    mem_acquire();
+    mem_reserve();
+    mem_release();
+}
+#else
 /* 
  * mem_init - initialize the memory system model
  */
@@ -34,7 +114,10 @@ void mem_init(void)
               0);                  /* offset (dunno) */
   mem_max_addr = heap + MAX_HEAP;
   mem_brk = heap;                  /* heap is empty initially */
+  mem_map_lo = mem_max_addr;       /* and no regions are mapped */
+  mem_zero_mark = heap;            /* and none of it has been touched */
 }
+#endif
 
 /* 
  * mem_deinit - free the storage used by the memory system model
@@ -45,33 +128,378 @@ void mem_deinit(void)
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap whatever mem_mmap mapped. The old heap's bytes are left as
+ *    they were, so the zero mark stays, unless mem_map has handed out
+ *    regions above it, which the brk may now grow into.
  */
 void mem_reset_brk()
 {
+    mapping_t *m;
+
+    while ((m = mem_mappings) != NULL) {
+        mem_mappings = m->next;
+        munmap(m->lo, m->size);
+        free(m);
+    }
+    mem_mapped = 0;
     mem_brk = heap;
+    if (mem_map_lo < mem_max_addr)
+        mem_zero_mark = mem_max_addr;
+    mem_map_lo = mem_max_addr;
+    mem_peak = mem_mapped;
+}
+
+/*
+ * Returns the bytes that the heap, mem_map and, in the simulated memory,
+ * mem_mmap may still take, all from the same MAX_HEAP bytes. Real mappings
+ * lie outside the reserved heap, and the OS alone bounds them. Called with
+ * mem_lock held.
+ */
+static size_t mem_room(void)
+{
+#ifdef REAL_MEMORY
+    return (size_t)(mem_map_lo - mem_brk);
+#else
+    return (size_t)(mem_map_lo - mem_brk) - mem_mapped;
+#endif
+}
+
+/* Raises the peak footprint to the current one; called with mem_lock held */
+static void mem_update_peak(void)
+{
+    size_t footprint = (size_t)(mem_brk - heap) + mem_mapped;
+
+    if (footprint > mem_peak)
+        mem_peak = footprint;
 }
 
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap can only be shrunk by mem_shrink.
  */
 void *mem_sbrk(long incr) 
 {
+    mem_acquire();
+#ifdef REAL_MEMORY
+    if (mem_reserve() < 0) {
+        mem_release();
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+#endif
     unsigned char *old_brk = mem_brk;
 
-    if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((incr < 0) || ((size_t)incr > mem_room())) {
+        mem_release();
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
+#ifdef REAL_MEMORY
+    if (mem_brk + incr > mem_open_hi) {
+        size_t page = mem_pagesize();
+        unsigned char *open_hi = (unsigned char *)
+            (((size_t)mem_brk + incr + page - 1) & ~(page - 1));
+        if (mem_open(mem_open_hi, open_hi - mem_open_hi) < 0) {
+            mem_release();
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        mem_open_hi = open_hi;
+    }
+#endif
 
-    mem_brk += incr;
+    __atomic_store_n(&mem_brk, mem_brk + incr, __ATOMIC_RELEASE);
+    if (mem_brk > mem_zero_mark)
+        mem_zero_mark = mem_brk;   /* the caller may write all it was given */
+    mem_update_peak();
+    mem_release();
     return (void *)old_brk;
 }
 
+/*
+ * mem_shrink - moves the brk down by decr bytes, giving the whole pages
+ *    above the new brk back to the OS. Returns -1 if the heap holds
+ *    fewer than decr bytes.
+ */
+int mem_shrink(size_t decr)
+{
+    mem_acquire();
+    if (decr > (size_t)(mem_brk - heap)) {
+        mem_release();
+        return -1;
+    }
+    /* Still under the lock, so that no mem_sbrk can hand the pages out again first */
+    __atomic_store_n(&mem_brk, mem_brk - decr, __ATOMIC_RELEASE);
+    mem_decommit(mem_brk, decr);
+
+    /* The decommitted pages read as zero, which joins them to the zero top */
+    size_t page = mem_pagesize();
+    unsigned char *zeroed = (unsigned char *)
+        (((size_t)mem_brk + page - 1) & ~(page - 1));
+    if (zeroed < mem_zero_mark &&
+            mem_zero_mark <= (unsigned char *)(((size_t)mem_brk + decr) & ~(page - 1)))
+        mem_zero_mark = zeroed;
+    mem_release();
+    return 0;
+}
+
+/*
+ * mem_decommit - gives the whole pages within the len bytes at lo back to
+ *    the OS. They stay mapped, and read as zeros when next touched.
+ */
+void mem_decommit(void *lo, size_t len)
+{
+    size_t page = mem_pagesize();
+    unsigned char *start = (unsigned char *)
+        (((size_t)lo + page - 1) & ~(page - 1));
+    unsigned char *end = (unsigned char *)(((size_t)lo + len) & ~(page - 1));
+
+    if (end > start)
+        madvise(start, end - start, MADV_DONTNEED);
+}
+
+/*
+ * mem_map - hands out a region of size bytes, aligned to size (a power
+ *    of two), from the top of the simulated address space. The brk can
+ *    never grow into a mapped region. Returns NULL when out of room.
+ */
+void *mem_map(size_t size)
+{
+    mem_acquire();
+#ifdef REAL_MEMORY
+    if (mem_reserve() < 0) {
+        mem_release();
+        errno = ENOMEM;
+        return NULL;
+    }
+#endif
+    unsigned char *region = (unsigned char *)
+        (((size_t)mem_map_lo - size) & ~(size - 1));
+
+    if (size > (size_t)(mem_map_lo - heap) ||
+            (size_t)(mem_map_lo - region) > mem_room()) {
+        mem_release();
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+        return NULL;
+    }
+#ifdef REAL_MEMORY
+    if (mem_open(region, size) < 0) {
+        mem_release();
+        errno = ENOMEM;
+        return NULL;
+    }
+#endif
+
+    mem_map_lo = region;
+    mem_release();
+    return (void *)region;
+}
+
+/*
+ * mem_mmap - maps size bytes, rounded up to whole pages, from the OS,
+ *    outside the simulated heap, for an allocation too large to be
+ *    worth carving from it. Returns NULL when out of memory. The bytes
+ *    count against the peak footprint like heap bytes, and in the
+ *    simulated memory against MAX_HEAP too.
+ */
+void *mem_mmap(size_t size)
+{
+#ifndef REAL_MEMORY
+    mapping_t *m;
+#endif
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+#ifdef REAL_MEMORY
+    void *lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo == MAP_FAILED)
+        return NULL;
+
+    mem_acquire();
+    mem_mapped += size;
+    mem_update_peak();
+    mem_release();
+    return lo;
+#else
+    /* Take the bytes from the budget first, so that no other thread can */
+    mem_acquire();
+    if (size > mem_room()) {
+        mem_release();
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_mmap failed. Ran out of memory...\n");
+        return NULL;
+    }
+    mem_mapped += size;
+    mem_release();
+
+    if ((m = malloc(sizeof(mapping_t))) == NULL ||
+            (m->lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        free(m);
+        mem_acquire();
+        mem_mapped -= size;
+        mem_release();
+        return NULL;
+    }
+    m->size = size;
+
+    mem_acquire();
+    m->next = mem_mappings;
+    mem_mappings = m;
+    mem_update_peak();
+    mem_release();
+    return m->lo;
+#endif
+}
+
+#ifndef REAL_MEMORY
+/* Returns the link to the mapping of size bytes starting at lo; called with
+   mem_lock held */
+static mapping_t **mem_find_mapping(void *lo, size_t size)
+{
+    mapping_t **mp;
+
+    for (mp = &mem_mappings; *mp != NULL && (*mp)->lo != lo; mp = &(*mp)->next)
+        ;
+    if (*mp == NULL) {
+        fprintf(stderr, "ERROR: %p was not mapped by mem_mmap\n", lo);
+        abort();
+    }
+    if ((*mp)->size != size) {
+        fprintf(stderr, "ERROR: %p was mapped with %zu bytes, not %zu\n",
+                lo, (*mp)->size, size);
+        abort();
+    }
+    return mp;
+}
+#endif
+
+/*
+ * mem_munmap - gives the mapping of size bytes at lo, from mem_mmap, back
+ *    to the OS
+ */
+void mem_munmap(void *lo, size_t size)
+{
+#ifndef REAL_MEMORY
+    mapping_t **mp, *m;
+#endif
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+#ifdef REAL_MEMORY
+    munmap(lo, size);
+    mem_acquire();
+    mem_mapped -= size;
+    mem_release();
+#else
+    mem_acquire();
+    mp = mem_find_mapping(lo, size);
+    m = *mp;
+    *mp = m->next;
+    mem_mapped -= m->size;
+    mem_release();
+
+    munmap(m->lo, m->size);
+    free(m);
+#endif
+}
+
+/*
+ * mem_mremap - resizes the mapping of old_size bytes at lo, from mem_mmap,
+ *    to size bytes, rounded up to whole pages, moving it only if it cannot
+ *    grow in place. The kernel moves the pages rather than copying them.
+ *    Returns the new address, or NULL (leaving the mapping as it was). In
+ *    the simulated memory, growth beyond MAX_HEAP fails too.
+ */
+void *mem_mremap(void *lo, size_t old_size, size_t size)
+{
+#ifndef REAL_MEMORY
+    mapping_t **mp, *m;
+#endif
+    void *new_lo;
+
+    old_size = (old_size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+#ifdef REAL_MEMORY
+    new_lo = mremap(lo, old_size, size, MREMAP_MAYMOVE);
+    if (new_lo == MAP_FAILED)
+        return NULL;
+    mem_acquire();
+    mem_mapped += size - old_size;
+    mem_update_peak();
+    mem_release();
+    return new_lo;
+#else
+    /* Take any growth from the budget first, as mem_mmap does */
+    mem_acquire();
+    mp = mem_find_mapping(lo, old_size);
+    m = *mp;
+    if (size > old_size && size - old_size > mem_room()) {
+        mem_release();
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_mremap failed. Ran out of memory...\n");
+        return NULL;
+    }
+    if (size > old_size)
+        mem_mapped += size - old_size;
+    mem_release();
+
+    new_lo = mremap(m->lo, old_size, size, MREMAP_MAYMOVE);
+    if (new_lo == MAP_FAILED) {
+        if (size > old_size) {
+            mem_acquire();
+            mem_mapped -= size - old_size;
+            mem_release();
+        }
+        return NULL;
+    }
+
+    mem_acquire();
+    if (size < old_size)
+        mem_mapped -= old_size - size;
+    m->lo = new_lo;
+    m->size = size;
+    mem_update_peak();
+    mem_release();
+    return new_lo;
+#endif
+}
+
+/*
+ * mem_is_mapped - returns whether the size bytes at lo all lie within
+ *    one mapping from mem_mmap, which with REAL_MEMORY is never known
+ */
+int mem_is_mapped(void *lo, size_t size)
+{
+    mapping_t *m;
+    int found = 0;
+
+    mem_acquire();
+    for (m = mem_mappings; m != NULL && !found; m = m->next)
+        found = (char *)lo >= (char *)m->lo &&
+                (char *)lo + size <= (char *)m->lo + m->size;
+    mem_release();
+    return found;
+}
+
+/*
+ * mem_zero_lo - returns the lowest address above the brk from which every
+ *    byte of the heap area is known to be zero: it has never been handed
+ *    out by mem_sbrk, or was decommitted by mem_shrink since. The bytes a
+ *    mem_sbrk hands out at or above it read as zero until written.
+ */
+void *mem_zero_lo(void)
+{
+    mem_acquire();
+    void *zero_lo = mem_zero_mark;
+    mem_release();
+    return zero_lo;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -85,7 +513,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - 1);
 }
 
 /*
@@ -93,7 +521,24 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)((void *)mem_brk - (void *)heap);
+    return (size_t)((void *)__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - (void *)heap);
+}
+
+/*
+ * mem_mappedsize() - returns the bytes in the mappings from mem_mmap
+ */
+size_t mem_mappedsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest the heap plus the mappings
+ *    from mem_mmap have been, in bytes, since the heap was last reset
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak;
 }
 
 /*
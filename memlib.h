@@ -3,9 +3,19 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(long incr);
+void *mem_zero_lo(void);
+int mem_shrink(size_t decr);
+void mem_decommit(void *lo, size_t len);
+void *mem_map(size_t size);
+void *mem_mmap(size_t size);
+void mem_munmap(void *lo, size_t size);
+void *mem_mremap(void *lo, size_t old_size, size_t size);
+int mem_is_mapped(void *lo, size_t size);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mappedsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
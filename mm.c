@@ -1,16 +1,39 @@
 /*
  * This program is a dynamic memory manager that works under 16 byte alignment
- * and heap sizes of 2^64 bytes and smaller. Free blocks in memory are stored
- * in an explicit linked list data structure wherein each free block stores
- * pointers to the next and previous blocks in the list. Allocated blocks are implicitly
- * stored in memory (they are not tracked by a data structure) and are appended
- * to the front of the free list upon being freed (Last In First Out imple-
- * mentation). All blocks have an identical 8 byte header and footer that each store
- * the size of the respective block (including the header and footer space) and
- * whether the block is allocated or not. The free list is not ordered or sorted
- * in any particular manner. Free blocks are always coalesced with adjacent blocks.
+ * and heap sizes of 2^64 bytes and smaller. Free blocks in memory are stored in
+ * an array of segregated explicit linked lists, one per size class, wherein
+ * each free block stores pointers to the next and previous blocks in its list.
+ * Allocated blocks are implicitly stored in memory (they are not tracked by a
+ * data structure) and are appended to the front of their size class's list upon
+ * being freed (Last In First Out implementation), or, built with LIST_ORDER set
+ * to ADDRESS_ORDER, kept in address order in a treap. All blocks have an 8 byte
+ * header that stores the size of the respective block (including the header and
+ * footer space), whether the block is allocated, and whether the block before
+ * it is allocated. Only free blocks carry a footer, a copy of the header that
+ * lets a block being freed find its free left neighbour. A bitmap of non-empty
+ * size classes lets a request go straight to the classes that can satisfy it,
+ * where a bounded best fit is chosen. Free blocks are coalesced with adjacent
+ * blocks, though small ones first wait in quick bins for a request of their
+ * exact size and are coalesced in batches. Requests of at most 64 bytes skip
+ * the block heap and are served from page-sized runs of equal slots that carry
+ * no header at all.
+ * Requests of 256 KB and more get a mapping of their own instead, which free
+ * unmaps and realloc resizes with mremap.
+ * Every few thousand frees, the free top of the heap is trimmed by moving the
+ * break down, and large free blocks that have stayed idle have their pages
+ * decommitted.
+ * Built with THREAD_SAFE, threads are spread over several arenas, independent
+ * heaps each guarded by its own lock, and each thread keeps a small cache of
+ * recently freed blocks per size class in front of its arena. Arenas other than
+ * the first grow in aligned regions whose header names the owning arena, and
+ * blocks freed by a thread of another arena are queued on the owner without
+ * taking its lock.
+ * A sampling heap profiler records the call stacks of about one allocation per
+ * so many bytes allocated, and of those still live, for a profile that pprof
+ * reads.
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,9 +41,19 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <unwind.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
+#include "mm_policy.h"
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
 #ifdef DEBUG
@@ -35,12 +68,37 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define free_sized mm_free_sized
+#define malloc_batch mm_malloc_batch
+#define free_batch mm_free_batch
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define reallocarray mm_reallocarray
+#define free_aligned_sized mm_free_aligned_sized
+#define malloc_usable_size mm_malloc_usable_size
 #endif /* def DRIVER */
 
 /* W_SIZE is the size of a single header or footer (8 bytes)
  *  D_SIZE is the combined size of a header and footer (16 bytes) */
 static const size_t W_SIZE = sizeof(size_t);
 static const size_t D_SIZE = 2 * sizeof(size_t);
+/* Low bits of a header: ALLOC_BIT marks the block allocated, PREV_ALLOC_BIT marks
+ * the block immediately before it allocated (and so without a footer) */
+static const size_t ALLOC_BIT = 0x1;
+static const size_t PREV_ALLOC_BIT = 0x2;
+/* Set on a large free block by release_memory, and cleared by any change to the block:
+ * IDLE_BIT once it has been seen free, DECOMMITTED_BIT once its pages are decommitted */
+static const size_t IDLE_BIT = 0x4;
+static const size_t DECOMMITTED_BIT = 0x8;
+/* Set, with ALLOC_BIT, in the header of a huge block, which has its own mapping. It is
+ * the same bit as IDLE_BIT, which only free blocks carry */
+static const size_t HUGE_BIT = 0x4;
+/* Set in the header of an allocated heap or huge block that the heap profiler sampled. It
+ * is the same bit as DECOMMITTED_BIT, which only free blocks carry */
+static const size_t SAMPLED_BIT = 0x8;
 
 typedef struct {
     size_t header;
@@ -48,7 +106,7 @@ typedef struct {
      * declare it as a zero-length array.  This allows us to obtain a
      * pointer to the start of the payload. This struct is used to
      * represent blocks in memory, their size, and allocation boolean
-     * footer is stored at the end of the payload */
+     * footer is stored at the end of the payload of free blocks only */
     uint8_t payload[];
 } block_t;
 
@@ -57,11 +115,180 @@ typedef struct {
     block_t *next;
     block_t *prev;
 } freed_payload;
-/* mm_head_first is used as a heap prologue, mm_heap_last an epilogue, mm_free_head
-*  the head node of the free list of freed blocks -- Total global var cap: 24 bytes */
-static block_t *mm_heap_first = NULL;
-static block_t *mm_heap_last = NULL;
-static block_t *mm_free_head = NULL;
+
+typedef struct {
+    /* Used instead of freed_payload in ADDRESS_ORDER: the children of a freed block in the
+     * treap of its size class, and, in blocks of at least SMALL_LIMIT bytes only, the
+     * largest block size in its subtree */
+    block_t *left;
+    block_t *right;
+    size_t max_size;
+} tree_payload;
+
+typedef struct {
+    /* Used by blocks in a size tree: next and prev as in freed_payload link blocks of one
+     * size, and the first of them, which has no prev, is the tree node with children left
+     * and right */
+    block_t *next;
+    block_t *prev;
+    block_t *left;
+    block_t *right;
+} size_payload;
+/* The policies themselves are in mm_policy.h. TREE_CLASS is the first class kept in a size
+ * tree when USE_SIZE_TREE */
+#define USE_SIZE_TREE (LIST_ORDER == LIFO_ORDER && TREE_LIMIT != 0)
+#define TREE_CLASS (SMALL_LIMIT / 16 - 2 + (size_t)__builtin_ctzl((TREE_LIMIT | SMALL_LIMIT) / SMALL_LIMIT))
+#define NUM_QUICK_BINS (QUICK_LIMIT / 16 + 1) // indexed by block size / 16
+_Static_assert(!USE_SIZE_TREE || TREE_CLASS < NUM_CLASSES, "TREE_LIMIT above the last size class");
+_Static_assert(ALIGNMENT == 16, "blocks are laid out for 16 byte alignment");
+_Static_assert(NUM_CLASSES <= MM_STATS_CLASSES, "more size classes than mm_heapstats_t holds");
+/* Requests of at most RUN_LIMIT bytes are served from runs: RUN_SIZE aligned pages,
+ * each carved into equal slots of one 16 byte size class with no per-object header.
+ * A run is an ordinary allocated block to the rest of the heap */
+#define RUN_LIMIT 64
+#define NUM_RUN_CLASSES (RUN_LIMIT / 16)
+#define RUN_SIZE 4096
+#define RUN_MAP_WORDS (RUN_SIZE / 16 / 64)
+// The power of two pages at least as large as the heap, so that no two of its pages share a bit
+#define RUN_MAP_PAGES ((size_t)1 << (64 - __builtin_clzl((MAX_HEAP - 1) / RUN_SIZE)))
+_Static_assert(RUN_MAP_PAGES * RUN_SIZE >= MAX_HEAP, "run page map smaller than the heap");
+/* Built with THREAD_SAFE, threads are spread round robin over NUM_ARENAS independent
+ * arenas. Arena 0 owns the sbrk heap; the others grow in REGION_SIZE aligned regions
+ * from mem_map, each starting with a header that names its arena */
+#ifdef THREAD_SAFE
+#define REGION_SIZE ((size_t)1 << 22)
+#else
+#define NUM_ARENAS 1
+#endif
+
+typedef struct run {
+    // Runs of a class with at least one free slot are kept in a doubly linked list
+    struct run *next;
+    struct run *prev;
+    uint32_t slot_size;
+    uint32_t num_slots;
+    uint32_t num_free;
+    // Bit i is set when slot i is free; slots start after this header
+    uint64_t free_slots[RUN_MAP_WORDS];
+} run_t;
+
+/* An arena holds the state of one heap: heap_first is used as a heap prologue, heap_last
+ * an epilogue, free_lists the head nodes of the free lists of freed blocks, indexed by
+ * size class, and bit i of free_map is set exactly when free_lists[i] is non-empty.
+ * chunk_size is the granularity of every heap growth, and runs holds the runs with free
+ * slots of each class. free_bytes and free_counts count the blocks in the free lists, as
+ * quick_bytes and quick_count do those in the quick bins, and sbrks the calls to mem_sbrk.
+ * check_cursor is the block mm_checkheap_window checks next, or NULL for the first one */
+typedef struct arena {
+    block_t *heap_first;
+    block_t *heap_last;
+    block_t *free_lists[NUM_CLASSES];
+    uint64_t free_map;
+    size_t chunk_size;
+    run_t *runs[NUM_RUN_CLASSES];
+    size_t run_demand[NUM_RUN_CLASSES];
+    size_t num_frees;
+    block_t *quick_bins[NUM_QUICK_BINS];
+    size_t quick_count;
+    size_t quick_bytes;
+    size_t free_bytes;
+    size_t free_counts[NUM_CLASSES];
+    size_t sbrks;
+    block_t *check_cursor;
+#ifdef THREAD_SAFE
+    // Guards every field above; heap_first and heap_last are those of the newest region
+    pthread_mutex_t lock;
+    struct region *regions;
+    void *region_end;
+    // Pointers freed by threads of other arenas, singly linked through their first word
+    void *remote_frees;
+#endif
+} arena_t;
+
+#ifdef THREAD_SAFE
+typedef struct region {
+    // The arena owning every block of the region, and the region mapped before it
+    arena_t *arena;
+    struct region *next;
+} region_t;
+#endif
+
+/* Bit i of mm_run_pages is set when the RUN_SIZE page whose address is i modulo
+ * RUN_MAP_PAGES pages is a run, which is how free recognises slots */
+static uint64_t mm_run_pages[RUN_MAP_PAGES / 64];
+
+#ifdef THREAD_SAFE
+/* Each thread caches up to TCACHE_COUNT freed pointers of its own arena per bin, where
+ * bin i holds pointers with at least 16i usable bytes; a refill may add larger, unsplit
+ * blocks. An empty bin is refilled and a full bin drained TCACHE_BATCH blocks at a time
+ * under a single hold of the lock */
+#define TCACHE_BINS (SMALL_LIMIT / 16)
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH 8
+
+typedef struct {
+    // Value of mm_generation when the cached pointers were handed out
+    uint64_t generation;
+    uint32_t counts[TCACHE_BINS];
+    // Singly linked through the first word of each cached payload
+    void *bins[TCACHE_BINS];
+} tcache_t;
+
+/* mm_arena is the arena the heap functions act on, set when its lock is taken, and
+ * mm_home the arena the thread allocates from. mm_generation counts calls to mm_init so
+ * a thread can tell that its cache points into a heap that has since been reset */
+static arena_t mm_arenas[NUM_ARENAS] = {
+    [0 ... NUM_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static __thread arena_t *mm_arena = &mm_arenas[0];
+static __thread arena_t *mm_home = NULL;
+static uint32_t mm_next_arena = 0;
+static uint64_t mm_generation = 1;
+static __thread tcache_t mm_tcache;
+static pthread_key_t mm_tcache_key;
+static pthread_once_t mm_tcache_once = PTHREAD_ONCE_INIT;
+# define arena_lock(arena) (pthread_mutex_lock(&(arena)->lock), mm_arena = (arena))
+# define arena_unlock() pthread_mutex_unlock(&mm_arena->lock)
+#else
+static arena_t mm_arenas[NUM_ARENAS];
+# define mm_arena (&mm_arenas[0])
+# define get_home() (&mm_arenas[0])
+# define arena_lock(arena)
+# define arena_unlock()
+# define arena_enter(arena)
+#endif
+
+/* Counts of the calls to the allocation functions since mm_init, and the bytes in huge
+ * mappings. Built with THREAD_SAFE, each thread adds the calls it makes to a count of its
+ * own, which goes into mm_counts every COUNT_FLUSH calls and at thread exit */
+enum { COUNT_MALLOC, COUNT_FREE, COUNT_REALLOC, COUNT_IN_PLACE, COUNT_COPIED, NUM_COUNTS };
+static size_t mm_counts[NUM_COUNTS];
+static size_t mm_huge_bytes = 0;
+#ifdef THREAD_SAFE
+#define COUNT_FLUSH 256
+static __thread size_t mm_local_counts[NUM_COUNTS];
+static __thread size_t mm_local_calls;
+
+// Adds the calling thread's counts to mm_counts
+static void count_flush(void) {
+    for (size_t i = 0; i < NUM_COUNTS; i++) {
+        __atomic_add_fetch(&mm_counts[i], mm_local_counts[i], __ATOMIC_RELAXED);
+        mm_local_counts[i] = 0;
+    }
+    mm_local_calls = 0;
+}
+#endif
+// Adds n to the inputted count of calls
+static inline void count_calls(size_t counter, size_t n) {
+#ifdef THREAD_SAFE
+    mm_local_counts[counter] += n;
+    if (++mm_local_calls == COUNT_FLUSH) {
+        count_flush();
+    }
+#else
+    mm_counts[counter] += n;
+#endif
+}
 
 static inline void *incr_pointer(size_t bytes, void *pointer) {
     return (char*)pointer + bytes;
@@ -87,10 +314,25 @@ static inline size_t get_size(block_t *block) {
     return get_size_from_val(block->header);
 }
 
+// Keeps the previous-block-allocated bit already stored in the header
 static inline void set_header(block_t *block, size_t size, bool is_allocated) {
-    block->header = size | is_allocated;
+    block->header = size | (block->header & PREV_ALLOC_BIT) | is_allocated;
+}
+
+static inline bool is_prev_allocated(block_t *block) {
+    return block->header & PREV_ALLOC_BIT;
+}
+
+/* Stored as a whole, since the block may be allocated and its header read meanwhile by
+ * a thread freeing it */
+static inline void set_prev_allocated(block_t *block, bool prev_allocated) {
+    size_t header = block->header & ~PREV_ALLOC_BIT;
+    if (prev_allocated) {
+        header |= PREV_ALLOC_BIT;
+    }
+    __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
 }
-// Assumes header of block has already been set
+// Assumes header of block has already been set; only free blocks need a footer
 static inline void set_footer(block_t *block) {
     size_t size = get_size(block);
     size_t* footer = incr_pointer(size - W_SIZE, block);
@@ -103,21 +345,45 @@ static inline size_t *get_footer_from_header(size_t *header) {
 }
 
 static inline bool is_allocated_from_val(size_t val) {
-    return val & 0x1;
+    return val & ALLOC_BIT;
 }
 
 static inline bool is_allocated(block_t *block) {
     return is_allocated_from_val(block->header);
 }
+/* Returns the size of the block needed to hold a payload of the inputted size. Sizes too
+ * large for any heap get a block size no heap can grow to, rather than wrapping around */
+static inline size_t get_block_size(size_t size) {
+    if (size > (SIZE_MAX >> 2)) {
+        return (SIZE_MAX >> 2) & ~(size_t)(D_SIZE - 1);
+    }
+    size_t adj_size = round_up(size + W_SIZE, D_SIZE);
+    return adj_size < 2 * D_SIZE ? 2 * D_SIZE : adj_size;
+}
+// Returns the index of the free list that holds blocks of the inputted size
+static inline size_t get_class(size_t size) {
+    if (size < SMALL_LIMIT) {
+        return size / D_SIZE - 2;
+    }
+    size_t class = SMALL_LIMIT / D_SIZE - 2 +
+        (size_t)(__builtin_clzl(SMALL_LIMIT) - __builtin_clzl(size));
+    return class < NUM_CLASSES ? class : NUM_CLASSES - 1;
+}
 
 static inline void init_heap_first() {
-    mm_heap_first = (block_t*) mem_heap_lo();
-    mm_heap_first = (block_t*)incr_pointer(W_SIZE, mm_heap_first);
+    mm_arena->heap_first = (block_t*) mem_heap_lo();
+    mm_arena->heap_first = (block_t*)incr_pointer(W_SIZE, mm_arena->heap_first);
 }
 
+// The epilogue header is marked allocated, and so is the prologue before it
 static inline void init_heap_last() {
     void *last_heap_index = mem_heap_hi();
-    mm_heap_last = (block_t*)decr_pointer(D_SIZE - 1, last_heap_index);
+    mm_arena->heap_last = (block_t*)decr_pointer(D_SIZE - 1, last_heap_index);
+    mm_arena->heap_last->header = ALLOC_BIT | PREV_ALLOC_BIT;
+}
+
+static inline block_t *get_right(block_t *block) {
+    return (block_t*)incr_pointer(get_size(block), block);
 }
 // Assumes both blocks are freed
 static inline void set_next(block_t *block, block_t *next) {
@@ -139,242 +405,2366 @@ static inline block_t *get_prev(block_t *block) {
     freed_payload *block_links = (freed_payload*)(block->payload);
     return block_links->prev;
 }
-// Appends block to front of linked list of freed blocks
-static void block_append(block_t *block) {
-    set_next(block, mm_free_head);
-    if (mm_free_head != NULL) {
-        set_prev(mm_free_head, block);
+
+static inline tree_payload *get_links(block_t *block) {
+    return (tree_payload*)(block->payload);
+}
+// Returns the treap priority of the inputted block, a hash of its address
+static inline uint64_t get_priority(block_t *block) {
+    return (uintptr_t)block * 0x9e3779b97f4a7c15UL;
+}
+/* Returns the largest block size in the inputted subtree. A small class holds a single
+ * size, so its blocks, which may be too small to store a max size, need none */
+static inline size_t get_max_size(block_t *node) {
+    if (node == NULL) {
+        return 0;
     }
-    set_prev(block, NULL);
-    mm_free_head = block;
+    size_t size = get_size(node);
+    return size < SMALL_LIMIT ? size : get_links(node)->max_size;
 }
-// Removes block from linked list of freed blocks; assumes the block is freed
-static void block_remove(block_t *block) {
-    if (get_next(mm_free_head) == NULL) {
-        assert(block == mm_free_head);
-        mm_free_head = NULL;
+// Recomputes the max size of the inputted node from its children
+static inline void tree_update(block_t *node) {
+    size_t size = get_size(node);
+    if (size >= SMALL_LIMIT) {
+        size_t left_max = get_max_size(get_links(node)->left);
+        size_t right_max = get_max_size(get_links(node)->right);
+        if (left_max > size) {
+            size = left_max;
+        }
+        get_links(node)->max_size = right_max > size ? right_max : size;
+    }
+}
+/* Splits the inputted treap into the blocks below the inputted address, left in *below,
+ * and the blocks above it, left in *above */
+static void tree_split(block_t *node, block_t *key, block_t **below, block_t **above) {
+    if (node == NULL) {
+        *below = NULL;
+        *above = NULL;
+        return;
+    }
+    if (node < key) {
+        tree_split(get_links(node)->right, key, &get_links(node)->right, above);
+        *below = node;
     }
     else {
-        block_t *next = get_next(block);
-        block_t *prev = get_prev(block);
-        if (block == mm_free_head) {
-           set_prev(next, NULL);
-           mm_free_head = next;
+        tree_split(get_links(node)->left, key, below, &get_links(node)->left);
+        *above = node;
+    }
+    tree_update(node);
+}
+// Joins two treaps, every block of the first lying below every block of the second
+static block_t *tree_merge(block_t *below, block_t *above) {
+    if (below == NULL) {
+        return above;
+    }
+    if (above == NULL) {
+        return below;
+    }
+    if (get_priority(below) > get_priority(above)) {
+        get_links(below)->right = tree_merge(get_links(below)->right, above);
+        tree_update(below);
+        return below;
+    }
+    get_links(above)->left = tree_merge(below, get_links(above)->left);
+    tree_update(above);
+    return above;
+}
+// Inserts the inputted block into the inputted treap and returns the new root
+static block_t *tree_insert(block_t *node, block_t *block) {
+    if (node == NULL || get_priority(block) > get_priority(node)) {
+        tree_split(node, block, &get_links(block)->left, &get_links(block)->right);
+        tree_update(block);
+        return block;
+    }
+    if (block < node) {
+        get_links(node)->left = tree_insert(get_links(node)->left, block);
+    }
+    else {
+        get_links(node)->right = tree_insert(get_links(node)->right, block);
+    }
+    tree_update(node);
+    return node;
+}
+// Removes the inputted block from the inputted treap and returns the new root
+static block_t *tree_remove(block_t *node, block_t *block) {
+    if (node == block) {
+        return tree_merge(get_links(node)->left, get_links(node)->right);
+    }
+    if (block < node) {
+        get_links(node)->left = tree_remove(get_links(node)->left, block);
+    }
+    else {
+        get_links(node)->right = tree_remove(get_links(node)->right, block);
+    }
+    tree_update(node);
+    return node;
+}
+// Returns the lowest addressed block of the inputted treap of at least the inputted size
+static block_t *tree_first_fit(block_t *node, size_t size) {
+    while (node != NULL && get_max_size(node) >= size) {
+        if (get_max_size(get_links(node)->left) >= size) {
+            node = get_links(node)->left;
+        }
+        else if (get_size(node) >= size) {
+            return node;
         }
         else {
-            set_next(prev, next);
-            if (next) {
-                set_prev(next, prev);
+            node = get_links(node)->right;
+        }
+    }
+    return NULL;
+}
+
+static inline size_payload *get_size_links(block_t *block) {
+    return (size_payload*)(block->payload);
+}
+// Returns the size tree priority of the inputted block, a hash of its size
+static inline uint64_t get_size_priority(block_t *block) {
+    return get_size(block) * 0x9e3779b97f4a7c15UL;
+}
+/* Splits the inputted size tree into the nodes below the inputted size, left in *below,
+ * and the nodes above it, left in *above */
+static void size_split(block_t *node, size_t size, block_t **below, block_t **above) {
+    if (node == NULL) {
+        *below = NULL;
+        *above = NULL;
+    }
+    else if (get_size(node) < size) {
+        size_split(get_size_links(node)->right, size, &get_size_links(node)->right, above);
+        *below = node;
+    }
+    else {
+        size_split(get_size_links(node)->left, size, below, &get_size_links(node)->left);
+        *above = node;
+    }
+}
+// Joins two size trees, every node of the first smaller than every node of the second
+static block_t *size_merge(block_t *below, block_t *above) {
+    if (below == NULL) {
+        return above;
+    }
+    if (above == NULL) {
+        return below;
+    }
+    if (get_size_priority(below) > get_size_priority(above)) {
+        get_size_links(below)->right = size_merge(get_size_links(below)->right, above);
+        return below;
+    }
+    get_size_links(above)->left = size_merge(below, get_size_links(above)->left);
+    return above;
+}
+/* Inserts the inputted block into the inputted size tree and returns the new root. A block
+ * of a size already in the tree goes in the list behind its node */
+static block_t *size_insert(block_t *node, block_t *block) {
+    if (node != NULL && get_size(node) == get_size(block)) {
+        block_t *next = get_next(node);
+        set_next(block, next);
+        if (next != NULL) {
+            set_prev(next, block);
+        }
+        set_prev(block, node);
+        set_next(node, block);
+        return node;
+    }
+    if (node == NULL || get_size_priority(block) > get_size_priority(node)) {
+        set_next(block, NULL);
+        set_prev(block, NULL);
+        size_split(node, get_size(block), &get_size_links(block)->left, &get_size_links(block)->right);
+        return block;
+    }
+    if (get_size(block) < get_size(node)) {
+        get_size_links(node)->left = size_insert(get_size_links(node)->left, block);
+    }
+    else {
+        get_size_links(node)->right = size_insert(get_size_links(node)->right, block);
+    }
+    return node;
+}
+/* Removes the inputted tree node from the inputted size tree and returns the new root. The
+ * next block of its size, if any, takes over its place and, having the same priority, keeps
+ * the tree in heap order */
+static block_t *size_remove(block_t *node, block_t *block) {
+    if (node == block) {
+        block_t *next = get_next(block);
+        if (next == NULL) {
+            return size_merge(get_size_links(block)->left, get_size_links(block)->right);
+        }
+        set_prev(next, NULL);
+        get_size_links(next)->left = get_size_links(block)->left;
+        get_size_links(next)->right = get_size_links(block)->right;
+        return next;
+    }
+    if (get_size(block) < get_size(node)) {
+        get_size_links(node)->left = size_remove(get_size_links(node)->left, block);
+    }
+    else {
+        get_size_links(node)->right = size_remove(get_size_links(node)->right, block);
+    }
+    return node;
+}
+/* Returns a block of the smallest size in the inputted size tree that fits the inputted
+ * size, preferring one behind the node, which is removed without touching the tree */
+static block_t *size_best_fit(block_t *node, size_t size) {
+    block_t *best = NULL;
+    while (node != NULL) {
+        if (get_size(node) >= size) {
+            best = node;
+            if (get_size(node) == size) {
+                break;
             }
+            node = get_size_links(node)->left;
+        }
+        else {
+            node = get_size_links(node)->right;
         }
     }
+    if (best != NULL && get_next(best) != NULL) {
+        return get_next(best);
+    }
+    return best;
 }
-// Called when a new trace starts - pads heap and (re)initializes globals
-int mm_init(void) {
-    mm_free_head = NULL;
-    if (!(mem_sbrk((long)(2 * D_SIZE + W_SIZE)))) {
+// Returns whether the free blocks of the inputted class are kept in a size tree
+static inline bool is_tree_class(size_t class) {
+    return USE_SIZE_TREE && class >= TREE_CLASS;
+}
+/* Adds block to the free list of its size class: at the front, at its address in
+ * ADDRESS_ORDER, or into its size tree */
+static void block_append(block_t *block) {
+    size_t class = get_class(get_size(block));
+    block_t **head = &mm_arena->free_lists[class];
+    mm_arena->free_map |= (uint64_t)1 << class;
+    mm_arena->free_bytes += get_size(block);
+    mm_arena->free_counts[class]++;
+    if (LIST_ORDER == ADDRESS_ORDER) {
+        *head = tree_insert(*head, block);
+        return;
+    }
+    if (is_tree_class(class)) {
+        *head = size_insert(*head, block);
+        return;
+    }
+    set_next(block, *head);
+    if (*head != NULL) {
+        set_prev(*head, block);
+    }
+    set_prev(block, NULL);
+    *head = block;
+}
+/* Removes block from the free list of its size class; assumes the block is freed
+ * and that its header still holds the size it was appended with. A block behind a node of
+ * a size tree is unlinked like a list block */
+static void block_remove(block_t *block) {
+    mm_arena->free_bytes -= get_size(block);
+    mm_arena->free_counts[get_class(get_size(block))]--;
+    if (LIST_ORDER == ADDRESS_ORDER) {
+        size_t class = get_class(get_size(block));
+        mm_arena->free_lists[class] = tree_remove(mm_arena->free_lists[class], block);
+        if (mm_arena->free_lists[class] == NULL) {
+            mm_arena->free_map &= ~((uint64_t)1 << class);
+        }
+        return;
+    }
+    block_t *next = get_next(block);
+    block_t *prev = get_prev(block);
+    if (prev == NULL && is_tree_class(get_class(get_size(block)))) {
+        size_t class = get_class(get_size(block));
+        mm_arena->free_lists[class] = size_remove(mm_arena->free_lists[class], block);
+        if (mm_arena->free_lists[class] == NULL) {
+            mm_arena->free_map &= ~((uint64_t)1 << class);
+        }
+        return;
+    }
+    if (prev == NULL) {
+        size_t class = get_class(get_size(block));
+        assert(block == mm_arena->free_lists[class]);
+        mm_arena->free_lists[class] = next;
+        if (next == NULL) {
+            mm_arena->free_map &= ~((uint64_t)1 << class);
+        }
+    }
+    else {
+        set_next(prev, next);
+    }
+    if (next) {
+        set_prev(next, prev);
+    }
+}
+#ifdef THREAD_SAFE
+/* Maps a new region for the current arena and starts an empty heap in it, laid out like
+ * the sbrk heap after the region header. Fails for requests the region could not hold */
+static bool region_open(size_t size) {
+    size_t overhead = sizeof(region_t) + W_SIZE + 2 * D_SIZE;
+    if (round_up(size, mm_arena->chunk_size) > REGION_SIZE - overhead) {
+        return false;
+    }
+    region_t *region = mem_map(REGION_SIZE);
+    if (region == NULL) {
+        return false;
+    }
+    region->arena = mm_arena;
+    region->next = mm_arena->regions;
+    mm_arena->regions = region;
+    mm_arena->region_end = incr_pointer(REGION_SIZE, region);
+    mm_arena->heap_first = incr_pointer(sizeof(region_t) + W_SIZE, region);
+    mm_arena->heap_last = incr_pointer(D_SIZE, mm_arena->heap_first);
+    mm_arena->heap_last->header = ALLOC_BIT | PREV_ALLOC_BIT;
+    return true;
+}
+#endif
+/* Pads the heap and (re)initializes the state of the current arena, whose lock the
+ * caller holds. Arenas other than arena 0 start in a region of their own */
+static int heap_init(void) {
+    memset(mm_arena->free_lists, 0, sizeof(mm_arena->free_lists));
+    mm_arena->free_map = 0;
+    memset(mm_arena->runs, 0, sizeof(mm_arena->runs));
+    memset(mm_arena->run_demand, 0, sizeof(mm_arena->run_demand));
+    mm_arena->num_frees = 0;
+    memset(mm_arena->quick_bins, 0, sizeof(mm_arena->quick_bins));
+    mm_arena->quick_count = 0;
+    mm_arena->quick_bytes = 0;
+    mm_arena->free_bytes = 0;
+    memset(mm_arena->free_counts, 0, sizeof(mm_arena->free_counts));
+    mm_arena->sbrks = 0;
+    mm_arena->check_cursor = NULL;
+    mm_arena->chunk_size = CHUNK_PAGES ? CHUNK_PAGES * mem_pagesize() : D_SIZE;
+#ifdef THREAD_SAFE
+    if (mm_arena != &mm_arenas[0]) {
+        mm_arena->regions = NULL;
+        return region_open(0) ? 0 : -1;
+    }
+#endif
+    mm_arena->sbrks++;
+    if (mem_sbrk((long)(2 * D_SIZE + W_SIZE)) == (void*)-1) {
         return -1;
     }
     init_heap_first();
     init_heap_last();
     return 0;
 }
-// Expands the heap and returns a new block of the inputted size
-static block_t *create_space(size_t size) {
-    mem_sbrk((long)(size));
-    block_t *block = mm_heap_last;
-    mm_heap_last = (block_t*)incr_pointer(size, mm_heap_last);
-    set_header(block, size, true);
-    set_footer(block);
-    return block;
-}
 // Splits the inputted block into a block to be allocated and a new free block
 static block_t *split(block_t *block, size_t size) {
     block_remove(block);
     size_t old_size = get_size(block);
     set_header(block, size, true);
-    set_footer(block);
     block_t *split_free = (block_t*)(incr_pointer(size, block));
+    split_free->header = PREV_ALLOC_BIT;
     set_header(split_free, old_size - size, false);
     set_footer(split_free);
     block_append(split_free);
     return block;
 }
-// Traverses the free list to find a block valid for allocation
-static block_t *find_fit(size_t size) {
-    block_t *curr = mm_free_head;
-    while (curr != NULL) {
+// Allocates the inputted free block, splitting off any remainder large enough to be a block
+static block_t *place(block_t *block, size_t size) {
+    if (get_size(block) >= 2 * D_SIZE + size) {
+        return split(block, size);
+    }
+    block_remove(block);
+    set_header(block, get_size(block), true);
+    set_prev_allocated(get_right(block), true);
+    return block;
+}
+/* Returns a block of the inputted class that fits the inputted size, chosen by FIT_POLICY,
+ * or the lowest addressed one in ADDRESS_ORDER, or the best one in a size tree */
+static block_t *search_class(size_t class, size_t size) {
+    if (LIST_ORDER == ADDRESS_ORDER) {
+        return tree_first_fit(mm_arena->free_lists[class], size);
+    }
+    if (is_tree_class(class)) {
+        return size_best_fit(mm_arena->free_lists[class], size);
+    }
+    block_t *best = NULL;
+    size_t best_size = SIZE_MAX;
+    size_t depth = BEST_FIT_DEPTH;
+    block_t *next;
+    // The next block's header is fetched while this one is tested, rather than after
+    for (block_t *curr = mm_arena->free_lists[class]; curr != NULL; curr = next) {
+        next = get_next(curr);
+        __builtin_prefetch(next);
+        if (best != NULL && depth-- == 0) {
+            break;
+        }
         size_t curr_size = get_size(curr);
-        if (curr_size >= 2 * D_SIZE + size) {
-                return split(curr, size);
+        if (curr_size >= size && curr_size < best_size) {
+            if (FIT_POLICY == FIRST_FIT || curr_size == size) {
+                return curr;
+            }
+            best = curr;
+            best_size = curr_size;
         }
-        else if (curr_size >= size) {
-            block_remove(curr);
-            set_header(curr, get_size(curr), true);
-            set_footer(curr);
-            return curr;
+    }
+    return best;
+}
+/* Searches the non-empty free lists, starting at the size class of the request, for
+ * a block valid for allocation. The arena's free_map lets each empty class be skipped with a
+ * single count trailing zeros instead of a load of its list head */
+static block_t *find_fit(size_t size) {
+    uint64_t map = mm_arena->free_map & (~(uint64_t)0 << get_class(size));
+    while (map != 0) {
+        block_t *fit = search_class((size_t)__builtin_ctzl(map), size);
+        if (fit != NULL) {
+            return place(fit, size);
         }
-        curr = get_next(curr);
+        map &= map - 1;
     }
     return NULL;
 }
-// Returns 16-byte aligned pointer to an allocated space in memory of the inputted size
-void *malloc(size_t size) {
-    if (!mm_heap_first) {
-        mm_init();
-    }
-    if (size == 0) {
-        return NULL;
-    }
-    size_t adj_size = D_SIZE + round_up(size, D_SIZE);
-    block_t *block = find_fit(adj_size);
-    if (block == NULL) {
-        block = create_space(adj_size);
+/* Keeps the check cursor on a block when the inputted block it may point at is merged into
+ * the inputted one before it */
+static inline void check_merged(block_t *gone, block_t *into) {
+    if (mm_arena->check_cursor == gone) {
+        mm_arena->check_cursor = into;
     }
-    return incr_pointer(W_SIZE, block);
 }
-
+/* Merges the inputted free block, which is in no free list, into its left neighbour if that
+ * neighbour is free. Only then does the left neighbour have a footer to read; the prologue
+ * counts as allocated */
 static block_t *coalesce_left(block_t *block) {
-    size_t *left_footer_pt = decr_pointer(W_SIZE, block);
-    if ((void*)left_footer_pt != incr_pointer(W_SIZE, mm_heap_first)) {
-        size_t left_footer = *left_footer_pt;
+    if (!is_prev_allocated(block)) {
+        size_t left_footer = *(size_t*)decr_pointer(W_SIZE, block);
         size_t jump_dist = get_size_from_val(left_footer);
         block_t *left_block = decr_pointer(jump_dist, block);
-        if (!(is_allocated(left_block))) {
-            block_remove(block);
-            block_remove(left_block);
-            size_t new_size = get_size(block) + get_size(left_block);
-            set_header(left_block, new_size, false);
-            set_footer(left_block);
-            block_append(left_block);
-            block = left_block;
-        }
+        block_remove(left_block);
+        check_merged(block, left_block);
+        size_t new_size = get_size(block) + get_size(left_block);
+        set_header(left_block, new_size, false);
+        set_footer(left_block);
+        block = left_block;
     }
     return block;
 } 
-// Combines the inputted free block with potential adjacent free blocks
-static void coalesce(block_t *block) {
+/* Combines the inputted free block, which is in no free list, with potential adjacent free
+ * blocks and appends the result, so that a block is added to its list only once it is whole */
+static block_t *coalesce(block_t *block) {
     block = coalesce_left(block);
-    size_t block_size = get_size(block);
-    block_t *right_block = (block_t*)incr_pointer(block_size, block);
-    if (right_block != mm_heap_last && !(is_allocated(right_block))) {
-        coalesce_left(right_block);
+    block_t *right_block = get_right(block);
+    if (right_block != mm_arena->heap_last && !(is_allocated(right_block))) {
+        block_remove(right_block);
+        check_merged(right_block, block);
+        set_header(block, get_size(block) + get_size(right_block), false);
+        set_footer(block);
     }
+    block_append(block);
+    return block;
 }
 
-void free(void *ptr) {
-    if (!mm_heap_first) {
-        mm_init();
-    }
-    if (ptr == NULL) {
-        return;
-    }
-    block_t *to_free = (block_t*)decr_pointer(W_SIZE, ptr);
+/* Returns the inputted allocated block to the free lists and coalesces it, returning the
+ * free block it ends up in */
+static block_t *free_block(block_t *to_free) {
     set_header(to_free, get_size(to_free), false);
     set_footer(to_free);
-    block_append(to_free);
-    coalesce(to_free);
+    set_prev_allocated(get_right(to_free), false);
+    return coalesce(to_free);
 }
-/* Changes the size of the block by mallocing a new block, copying its data, 
- * and freeing the old block */
-void *realloc(void *old_ptr, size_t size) {
-    if (size == 0) {
-        free(old_ptr);
+/* Returns whether a block of the inputted size waits in a quick bin when freed. The limit is
+ * compared through a variable, so that a QUICK_LIMIT of 0 builds without a warning */
+static inline bool is_quick_size(size_t size) {
+    const size_t limit = QUICK_LIMIT;
+    return size < limit;
+}
+// Puts the inputted allocated block of less than QUICK_LIMIT bytes in its quick bin
+static void quick_push(block_t *block) {
+    size_t bin = get_size(block) / D_SIZE;
+    set_next(block, mm_arena->quick_bins[bin]);
+    mm_arena->quick_bins[bin] = block;
+    mm_arena->quick_count++;
+    mm_arena->quick_bytes += get_size(block);
+}
+// Takes a block of exactly the inputted size from its quick bin, or returns NULL
+static block_t *quick_pop(size_t size) {
+    if (!is_quick_size(size) || mm_arena->quick_bins[size / D_SIZE] == NULL) {
         return NULL;
     }
-    if (!old_ptr) {
-        return malloc(size);
-    }
-    void *new_ptr = malloc(size);
-    if (!new_ptr) {
-        return NULL;
+    block_t *block = mm_arena->quick_bins[size / D_SIZE];
+    mm_arena->quick_bins[size / D_SIZE] = get_next(block);
+    mm_arena->quick_count--;
+    mm_arena->quick_bytes -= size;
+    return block;
+}
+// Frees and coalesces every block in the quick bins
+static void consolidate() {
+    for (size_t bin = 0; bin < NUM_QUICK_BINS; bin++) {
+        block_t *block = mm_arena->quick_bins[bin];
+        while (block != NULL) {
+            block_t *next = get_next(block);
+            free_block(block);
+            block = next;
+        }
+        mm_arena->quick_bins[bin] = NULL;
     }
-    block_t *block = (block_t*)decr_pointer(W_SIZE, old_ptr);
-    size_t old_size = get_size(block) - D_SIZE;
-    if (size < old_size) {
-        old_size = size;
+    mm_arena->quick_count = 0;
+    mm_arena->quick_bytes = 0;
+}
+/* Returns the block at the top of the heap that new space would be carved from: the
+ * wilderness block if the block before the epilogue is free, or else the epilogue */
+static block_t *get_top() {
+    if (is_prev_allocated(mm_arena->heap_last)) {
+        return mm_arena->heap_last;
     }
-    memcpy(new_ptr, old_ptr, old_size);
-    free(old_ptr);
-    return new_ptr;
+    size_t top_size = get_size_from_val(*(size_t*)decr_pointer(W_SIZE, mm_arena->heap_last));
+    return (block_t*)decr_pointer(top_size, mm_arena->heap_last);
 }
-// Allocates a block and sets it to zero
-void *calloc(size_t nmemb, size_t size) {
-    size_t bytes = nmemb * size;
-    void *new_ptr = malloc(bytes);
-    /* If malloc() fails, skip zeroing out the memory. */
-    if (new_ptr) {
-        memset(new_ptr, 0, bytes);
+/* Makes room for the epilogue to move up by the inputted number of bytes: arena 0 moves
+ * the break, and the other arenas grow within their newest region */
+static bool heap_grow(size_t grow) {
+#ifdef THREAD_SAFE
+    if (mm_arena != &mm_arenas[0]) {
+        return pointer_dif(mm_arena->region_end, mm_arena->heap_last) >= grow + D_SIZE;
     }
-    return new_ptr;
+#endif
+    mm_arena->sbrks++;
+    return mem_sbrk((long)grow) != (void*)-1;
 }
-// Prints runtime errors in the heap's implementation and the line at which they occur
-void mm_checkheap(int verbose) {
-    void *heap_lo = mem_heap_lo();
-    void *heap_hi = mem_heap_hi();
-    if (mm_heap_first == NULL) {
-        printf("Error: prologue is null. Line %d", verbose);
+/* Grows the heap by at least the inputted number of bytes, and never by less than a
+ * minimum block, rounded up to whole chunks. Returns the free wilderness block that
+ * now ends the heap, or NULL on failure */
+static block_t *extend_heap(size_t size) {
+    size_t grow = round_up(size < 2 * D_SIZE ? 2 * D_SIZE : size, mm_arena->chunk_size);
+    if (!heap_grow(grow)) {
+        return NULL;
     }
-    else if ((void*)mm_heap_first != heap_lo + W_SIZE) {
-        printf("Error: prologue has been moved. Line %d", verbose);
+    block_t *block = mm_arena->heap_last;
+    mm_arena->heap_last = (block_t*)incr_pointer(grow, mm_arena->heap_last);
+    mm_arena->heap_last->header = ALLOC_BIT;
+    set_header(block, grow, false);
+    set_footer(block);
+    return coalesce(block);
+}
+/* Returns a new block of the inputted size carved from the top of the heap, growing
+ * the wilderness block only by what it lacks, if anything, or moving to a new region
+ * once the newest one is full */
+static block_t *create_space(size_t size) {
+    block_t *top = get_top();
+    size_t top_size = top == mm_arena->heap_last ? 0 : get_size(top);
+    if (top_size < size) {
+        top = extend_heap(size - top_size);
+#ifdef THREAD_SAFE
+        if (top == NULL && mm_arena != &mm_arenas[0] && region_open(size)) {
+            top = extend_heap(size);
+        }
+#endif
+        if (top == NULL) {
+            return NULL;
+        }
     }
-    if (mm_heap_last == NULL) {
-        printf("Error: epilogue is null. Line %d", verbose);
+    return place(top, size);
+}
+// Cuts the inputted allocated block down to the inputted size, freeing any large enough tail
+static void shrink_block(block_t *block, size_t size) {
+    size_t old_size = get_size(block);
+    if (old_size < 2 * D_SIZE + size) {
+        return;
     }
-    else if ((void*)mm_heap_last != decr_pointer(D_SIZE - 1 ,heap_hi)) {
-        printf("Error: epilogue has been moved. Line %d", verbose);
+    set_header(block, size, true);
+    block_t *tail = (block_t*)incr_pointer(size, block);
+    tail->header = PREV_ALLOC_BIT;
+    set_header(tail, old_size - size, true);
+    free_block(tail);
+}
+/* Returns the gap from the inputted block to the nearest block whose payload is aligned
+ * to align bytes. A non-zero gap must be able to hold a free block of its own */
+static size_t aligned_gap(block_t *block, size_t align) {
+    uintptr_t payload = (uintptr_t)block->payload;
+    size_t gap = round_up(payload, align) - payload;
+    if (gap != 0 && gap < 2 * D_SIZE) {
+        gap += align;
     }
-    block_t *curr = incr_pointer(D_SIZE, mm_heap_first);
-    block_t *prev = NULL;
-    int64_t num_free_check = 0;
-    while (curr != mm_heap_last) {
-        if (prev != NULL) {
-            if (!is_allocated(curr)) {
-                num_free_check++;
-                if (!is_allocated(prev)) {
-                    printf("Error: failure to coalesce. Line %d", verbose);
-                }
-            }
-        }
-        size_t size = get_size(curr);
-        if (size % D_SIZE != 0) {
-            printf("Error: block is not aligned. Line %d", verbose);
-        }
-        if ((void*)curr < heap_lo || (void*)curr > heap_hi) {
-            printf("Error: block is outside of heap boundary. Line %d", verbose);
-        }
-        size_t *footer = get_footer_from_header((size_t*)curr);
-        if (curr->header != *footer) {
-            printf("Error: a footer is not equivalent to its header. Line %d", verbose);
-        }
-        if (size < 2 * D_SIZE) {
-            printf("Error: size of block is below minimum size. Line %d", verbose);
+    return gap;
+}
+/* Returns an allocated block of the inputted size whose payload is aligned to align
+ * bytes. The leading gap and any unused tail are split off as free blocks */
+static block_t *alloc_aligned(size_t size, size_t align) {
+    block_t *block = find_fit(size + align + 2 * D_SIZE);
+    if (block == NULL) {
+        block = create_space(aligned_gap(get_top(), align) + size);
+        // Growth into a new region changes the gap, so the space is carved again there
+        if (block != NULL && get_size(block) < aligned_gap(block, align) + size) {
+            free_block(block);
+            block = create_space(aligned_gap(get_top(), align) + size);
         }
-        if (pointer_dif(curr, mm_heap_first) % D_SIZE != 0) {
-            printf("Error: block address not aligned. Line %d", verbose);
+        if (block == NULL) {
+            return NULL;
         }
-        prev = curr;
-        curr = (block_t*)incr_pointer(size, curr);
-    }
-    if (mm_free_head != NULL) {
-        curr = mm_free_head;
-        prev = NULL;
-        while (curr != NULL) {
-            if (get_prev(curr) != prev) {
-                printf("Error: prev of curr not matched with next of prev. Line %d", verbose);
-            }
-            if ((void*)curr < heap_lo || (void*)curr > heap_hi) {
-                printf("Error: free block outside of heap boundaries. Line %d", verbose);
-            }
-            num_free_check--;
-            prev = curr;
-            curr = get_next(curr);
+    }
+    size_t gap = aligned_gap(block, align);
+    if (gap != 0) {
+        size_t block_size = get_size(block);
+        set_header(block, gap, true);
+        block_t *aligned = (block_t*)incr_pointer(gap, block);
+        aligned->header = PREV_ALLOC_BIT;
+        set_header(aligned, block_size - gap, true);
+        free_block(block);
+        block = aligned;
+    }
+    shrink_block(block, size);
+    return block;
+}
+
+static inline size_t run_header_size() {
+    return round_up(sizeof(run_t), D_SIZE);
+}
+// Returns the index in mm_run_pages of the inputted address's RUN_SIZE page
+static inline size_t get_page(void *ptr) {
+    return (uintptr_t)ptr / RUN_SIZE % RUN_MAP_PAGES;
+}
+
+// Other bits of the word may change concurrently, so the word is read atomically
+static inline bool is_run_page(size_t page) {
+    return (__atomic_load_n(&mm_run_pages[page / 64], __ATOMIC_RELAXED) >> (page % 64)) & 1;
+}
+
+// Arenas share words of mm_run_pages, so bits are flipped atomically
+static inline void set_run_page(size_t page, bool is_run) {
+    if (is_run) {
+        __atomic_fetch_or(&mm_run_pages[page / 64], (uint64_t)1 << (page % 64), __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_and(&mm_run_pages[page / 64], ~((uint64_t)1 << (page % 64)), __ATOMIC_RELAXED);
+    }
+}
+// Returns the run that owns the inputted slot pointer
+static inline run_t *get_run(void *ptr) {
+    return (run_t*)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1));
+}
+
+static void run_link(run_t *run, size_t class) {
+    run->next = mm_arena->runs[class];
+    run->prev = NULL;
+    if (mm_arena->runs[class] != NULL) {
+        mm_arena->runs[class]->prev = run;
+    }
+    mm_arena->runs[class] = run;
+}
+
+static void run_unlink(run_t *run, size_t class) {
+    if (run->prev == NULL) {
+        mm_arena->runs[class] = run->next;
+    }
+    else {
+        run->prev->next = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+// Carves a new page-aligned block from the heap into a run of the inputted class
+static run_t *run_create(size_t class) {
+    block_t *block = alloc_aligned(RUN_SIZE + D_SIZE, RUN_SIZE);
+    if (block == NULL) {
+        return NULL;
+    }
+    run_t *run = (run_t*)block->payload;
+    run->slot_size = (class + 1) * D_SIZE;
+    run->num_slots = (RUN_SIZE - run_header_size()) / run->slot_size;
+    run->num_free = run->num_slots;
+    memset(run->free_slots, 0, sizeof(run->free_slots));
+    for (size_t i = 0; i < run->num_slots; i++) {
+        run->free_slots[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+    set_run_page(get_page(run), true);
+    run_link(run, class);
+    return run;
+}
+// Hands out the lowest free slot of a run of the inputted class
+static void *run_malloc(size_t class) {
+    run_t *run = mm_arena->runs[class];
+    if (run == NULL) {
+        run = run_create(class);
+        if (run == NULL) {
+            return NULL;
         }
     }
-    if (num_free_check < 0) {
-        printf("Error: free list storing more blocks than are freed. Line %d", verbose);
+    size_t word = 0;
+    while (run->free_slots[word] == 0) {
+        word++;
     }
-    else if (num_free_check > 0) {
-        printf("Error: not all free blocks are being stored in list. Line %d", verbose);
+    size_t slot = word * 64 + (size_t)__builtin_ctzl(run->free_slots[word]);
+    run->free_slots[word] &= run->free_slots[word] - 1;
+    if (--run->num_free == 0) {
+        run_unlink(run, class);
+    }
+    return incr_pointer(run_header_size() + slot * run->slot_size, run);
+}
+/* Marks the inputted slot free. A run left empty goes back to the block heap unless
+ * it is the only run of its class with free slots */
+static void run_free(void *ptr) {
+    run_t *run = get_run(ptr);
+    size_t class = run->slot_size / D_SIZE - 1;
+    size_t slot = pointer_dif(ptr, incr_pointer(run_header_size(), run)) / run->slot_size;
+    run->free_slots[slot / 64] |= (uint64_t)1 << (slot % 64);
+    if (run->num_free++ == 0) {
+        run_link(run, class);
     }
-}
\ No newline at end of file
+    if (run->num_free == run->num_slots && (run->prev != NULL || run->next != NULL)) {
+        run_unlink(run, class);
+        set_run_page(get_page(run), false);
+        free_block((block_t*)decr_pointer(W_SIZE, run));
+    }
+}
+/* Returns whether the inputted pointer is the payload of a huge block. The header of an
+ * allocated heap block may have its PREV_ALLOC_BIT changed by its arena meanwhile */
+static inline bool is_huge(void *ptr) {
+    block_t *block = (block_t*)decr_pointer(W_SIZE, ptr);
+    return (uintptr_t)ptr % RUN_SIZE == D_SIZE &&
+        (__atomic_load_n(&block->header, __ATOMIC_RELAXED) & HUGE_BIT);
+}
+/* Returns whether the inputted size is too large for any block, setting errno to ENOMEM if
+ * so. Rounding a larger size up to a huge block's whole pages would wrap around */
+static inline bool too_large(size_t size) {
+    if (size > SIZE_MAX - D_SIZE - mem_pagesize()) {
+        errno = ENOMEM;
+        return true;
+    }
+    return false;
+}
+// Returns a payload of the inputted size in a huge block of its own mapping
+static void *huge_malloc(size_t size) {
+    size_t map_size = round_up(size + D_SIZE, mem_pagesize());
+    void *map = mem_mmap(map_size);
+    if (map == NULL) {
+        return NULL;
+    }
+    block_t *block = incr_pointer(W_SIZE, map);
+    block->header = map_size | HUGE_BIT | ALLOC_BIT;
+    __atomic_add_fetch(&mm_huge_bytes, map_size, __ATOMIC_RELAXED);
+    return block->payload;
+}
+// Unmaps the huge block at the inputted pointer
+static void huge_free(void *ptr) {
+    size_t map_size = get_size(decr_pointer(W_SIZE, ptr));
+    __atomic_sub_fetch(&mm_huge_bytes, map_size, __ATOMIC_RELAXED);
+    mem_munmap(decr_pointer(D_SIZE, ptr), map_size);
+}
+/* Resizes the mapping of the huge block at the inputted pointer to fit the inputted size.
+ * The kernel moves pages instead of copying them, however large the block */
+static void *huge_realloc(void *ptr, size_t size) {
+    size_t map_size = round_up(size + D_SIZE, mem_pagesize());
+    size_t old_size = get_size(decr_pointer(W_SIZE, ptr));
+    void *map = mem_mremap(decr_pointer(D_SIZE, ptr), old_size, map_size);
+    if (map == NULL) {
+        return NULL;
+    }
+    block_t *block = incr_pointer(W_SIZE, map);
+    block->header = map_size | HUGE_BIT | ALLOC_BIT;
+    __atomic_add_fetch(&mm_huge_bytes, map_size - old_size, __ATOMIC_RELAXED);
+    return block->payload;
+}
+
+/* Returns the number of payload bytes usable at the inputted allocated pointer. Only
+ * the size bits of the header are used, since a neighbour's free may flip the others */
+static size_t usable_size(void *ptr) {
+    if (is_huge(ptr)) {
+        return get_size(decr_pointer(W_SIZE, ptr)) - D_SIZE;
+    }
+    if (is_run_page(get_page(ptr))) {
+        return get_run(ptr)->slot_size;
+    }
+    block_t *block = (block_t*)decr_pointer(W_SIZE, ptr);
+    return get_size_from_val(__atomic_load_n(&block->header, __ATOMIC_RELAXED)) - W_SIZE;
+}
+// Returns whether the inputted address lies in the heap of the current arena
+static bool in_arena(void *ptr) {
+#ifdef THREAD_SAFE
+    if (mm_arena != &mm_arenas[0]) {
+        for (region_t *region = mm_arena->regions; region != NULL; region = region->next) {
+            if (ptr > (void*)region && ptr < incr_pointer(REGION_SIZE, region)) {
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+    return ptr >= mem_heap_lo() && ptr <= mem_heap_hi();
+}
+/* Checks the links of the inputted free block against the blocks they lead to, which checks
+ * its part of the free list without walking the list */
+static void check_free_links(block_t *curr, int verbose) {
+    size_t class = get_class(get_size(curr));
+    if (!(mm_arena->free_map & ((uint64_t)1 << class))) {
+        printf("Error: non-empty size class missing from free map. Line %d", verbose);
+    }
+    if (LIST_ORDER == ADDRESS_ORDER) {
+        block_t *left = get_links(curr)->left;
+        block_t *right = get_links(curr)->right;
+        if ((left != NULL && (left >= curr || is_allocated(left))) ||
+            (right != NULL && (right <= curr || is_allocated(right)))) {
+            printf("Error: free block out of address order. Line %d", verbose);
+        }
+        return;
+    }
+    block_t *next = get_next(curr);
+    block_t *prev = get_prev(curr);
+    // The node of a size tree has no prev, and its place in the tree is not checked here
+    bool is_node = prev == NULL && is_tree_class(class);
+    if ((prev == NULL && !is_node && mm_arena->free_lists[class] != curr) ||
+        (prev != NULL && get_next(prev) != curr) || (next != NULL && get_prev(next) != curr)) {
+        printf("Error: prev of curr not matched with next of prev. Line %d", verbose);
+    }
+}
+/* Checks the inputted block of the current arena, other than its prologue and epilogue, on its
+ * own and against its neighbours: the right one, and the left one when that is free and so
+ * found by its footer. Returns false if the block reaches out of the heap, ending a walk */
+static bool check_block(block_t *curr, int verbose) {
+    size_t size = get_size(curr);
+    if (size % D_SIZE != 0) {
+        printf("Error: block is not aligned. Line %d", verbose);
+    }
+    if ((uintptr_t)curr->payload % ALIGNMENT != 0) {
+        printf("Error: block address not aligned. Line %d", verbose);
+    }
+    if (size < 2 * D_SIZE) {
+        printf("Error: size of block is below minimum size. Line %d", verbose);
+    }
+    if (!in_arena(curr) || !in_arena(incr_pointer(size - 1, curr))) {
+        printf("Error: block is outside of heap boundary. Line %d", verbose);
+        return false;
+    }
+    block_t *right = get_right(curr);
+    if (!is_allocated(curr)) {
+        if (curr->header != *get_footer_from_header((size_t*)curr)) {
+            printf("Error: a footer is not equivalent to its header. Line %d", verbose);
+        }
+        if (get_size(right) != 0 && !is_allocated(right)) {
+            printf("Error: failure to coalesce. Line %d", verbose);
+        }
+        check_free_links(curr, verbose);
+    }
+    if (is_prev_allocated(right) != is_allocated(curr)) {
+        printf("Error: previous-allocated bit does not match left block. Line %d", verbose);
+    }
+    if (!is_prev_allocated(curr)) {
+        size_t left_size = get_size_from_val(*(size_t*)decr_pointer(W_SIZE, curr));
+        block_t *left = decr_pointer(left_size, curr);
+        if (left_size < 2 * D_SIZE || !in_arena(left) || is_allocated(left) || get_right(left) != curr) {
+            printf("Error: previous-allocated bit does not match left block. Line %d", verbose);
+        }
+    }
+    if (is_allocated(curr) && is_run_page(get_page(curr->payload))) {
+        run_t *run = (run_t*)curr->payload;
+        size_t num_free = 0;
+        for (size_t i = 0; i < RUN_MAP_WORDS; i++) {
+            num_free += (size_t)__builtin_popcountl(run->free_slots[i]);
+        }
+        if ((uintptr_t)run % RUN_SIZE != 0 || size < RUN_SIZE + W_SIZE) {
+            printf("Error: run is not a page-aligned block. Line %d", verbose);
+        }
+        if (num_free != run->num_free || run->num_free > run->num_slots) {
+            printf("Error: run free count does not match its slot bitmap. Line %d", verbose);
+        }
+    }
+    return true;
+}
+/* While mm_checkheap_touched has it on, malloc and free check each block of the heap they
+ * hand out, resize or free, with its neighbours, reporting errors with mm_check_verbose */
+static bool mm_check_touched = false;
+static int mm_check_verbose = 0;
+// The arena mm_checkheap_window checks next
+static size_t mm_check_arena = 0;
+/* Checks the inputted block, if checking touched blocks is on, and its left neighbour when
+ * that is free and its right one when that is not the epilogue */
+static inline void check_touched(block_t *block) {
+    if (__builtin_expect(__atomic_load_n(&mm_check_touched, __ATOMIC_RELAXED), 0)) {
+        int verbose = mm_check_verbose;
+        if (!check_block(block, verbose)) {
+            return;
+        }
+        if (!is_prev_allocated(block)) {
+            size_t left_size = get_size_from_val(*(size_t*)decr_pointer(W_SIZE, block));
+            block_t *left = decr_pointer(left_size, block);
+            if (in_arena(left) && get_right(left) == block) {
+                check_block(left, verbose);
+            }
+        }
+        if (get_size(get_right(block)) != 0) {
+            check_block(get_right(block), verbose);
+        }
+    }
+}
+// Returns 16-byte aligned pointer to an allocated space in memory of the inputted size
+static void *heap_malloc(size_t size) {
+    if (!mm_arena->heap_first && heap_init() < 0) {
+        return NULL;
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    if (size <= RUN_LIMIT) {
+        size_t class = (size - 1) / D_SIZE;
+        if (mm_arena->run_demand[class] >= RUN_THRESHOLD) {
+            void *ptr = run_malloc(class);
+            if (ptr != NULL) {
+                check_touched(decr_pointer(W_SIZE, get_run(ptr)));
+            }
+            return ptr;
+        }
+        mm_arena->run_demand[class]++;
+    }
+    size_t adj_size = get_block_size(size);
+    block_t *block = quick_pop(adj_size);
+    if (block == NULL) {
+        block = find_fit(adj_size);
+    }
+    if (block == NULL && mm_arena->quick_count != 0) {
+        consolidate();
+        block = find_fit(adj_size);
+    }
+    if (block == NULL) {
+        block = create_space(adj_size);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    check_touched(block);
+    return incr_pointer(W_SIZE, block);
+}
+
+/* Fills the inputted number of bytes at the inputted 16-byte aligned payload with zeros. At
+ * least STREAM_THRESHOLD bytes are written with non-temporal stores, which bypass the cache */
+static void zero_payload(void *ptr, size_t size) {
+#ifdef __SSE2__
+    if (size >= STREAM_THRESHOLD) {
+        __m128i *dst = ptr;
+        for (size_t i = 0; i < size / 16; i++) {
+            _mm_stream_si128(&dst[i], _mm_setzero_si128());
+        }
+        _mm_sfence();
+        memset(&dst[size / 16], 0, size % 16);
+        return;
+    }
+#endif
+    memset(ptr, 0, size);
+}
+// Copies between 16-byte aligned payloads as zero_payload fills them
+static void copy_payload(void *dst, const void *src, size_t size) {
+#ifdef __SSE2__
+    if (size >= STREAM_THRESHOLD) {
+        __m128i *to = dst;
+        const __m128i *from = src;
+        for (size_t i = 0; i < size / 16; i++) {
+            _mm_stream_si128(&to[i], _mm_load_si128(&from[i]));
+        }
+        _mm_sfence();
+        memcpy(&to[size / 16], &from[size / 16], size % 16);
+        return;
+    }
+#endif
+    memcpy(dst, src, size);
+}
+/* Returns a zeroed payload of the inputted size, larger than RUN_LIMIT. Space that arena 0
+ * has just taken from memlib above its zero mark reads as zero already, but for the words
+ * the heap wrote there while it was free: the links at the start of the free block and the
+ * footer at its end, which can fall in the last W_SIZE bytes of the payload */
+static void *heap_calloc(size_t size) {
+    char *zero_lo = NULL;
+    if (mm_arena == &mm_arenas[0]) {
+        zero_lo = mem_zero_lo();
+    }
+    char *ptr = heap_malloc(size);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    size_t dirty = size;
+    if (zero_lo != NULL && ptr + size > zero_lo + sizeof(size_payload)) {
+        dirty = 0;
+        if (ptr < zero_lo + sizeof(size_payload)) {
+            dirty = pointer_dif(zero_lo + sizeof(size_payload), ptr);
+        }
+        memset(ptr + size - W_SIZE, 0, W_SIZE);
+    }
+    zero_payload(ptr, dirty);
+    return ptr;
+}
+
+/* Returns a payload of the inputted size aligned to the inputted power of two above D_SIZE
+ * bytes. The gap in front of the aligned block goes back to the free lists */
+static void *heap_memalign(size_t size, size_t align) {
+    if (!mm_arena->heap_first && heap_init() < 0) {
+        return NULL;
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    block_t *block = alloc_aligned(get_block_size(size), align);
+    if (block == NULL) {
+        return NULL;
+    }
+    check_touched(block);
+    return incr_pointer(W_SIZE, block);
+}
+
+/* Carves n blocks for payloads of the inputted size, one after another, out of a single
+ * free block that fits them all, storing their payloads in ptrs. Without one, or for
+ * sizes whose class runs already serve, the blocks are allocated one at a time, which
+ * fills holes and run slots as lone mallocs would instead of growing the heap for the
+ * whole batch. Returns the number allocated */
+static size_t heap_malloc_batch(size_t size, size_t n, void **ptrs) {
+    if (!mm_arena->heap_first && heap_init() < 0) {
+        return 0;
+    }
+    size_t adj_size = get_block_size(size);
+    block_t *block = NULL;
+    if (size > RUN_LIMIT || mm_arena->run_demand[(size - 1) / D_SIZE] < RUN_THRESHOLD) {
+        block = find_fit(adj_size * n);
+    }
+    if (block == NULL) {
+        size_t count = 0;
+        while (count < n && (ptrs[count] = heap_malloc(size)) != NULL) {
+            count++;
+        }
+        return count;
+    }
+    if (size <= RUN_LIMIT) {
+        mm_arena->run_demand[(size - 1) / D_SIZE] += n;
+    }
+    // Each block but the last is cut to size, and the last keeps any slack of the fit
+    for (size_t i = 0; i + 1 < n; i++) {
+        size_t block_size = get_size(block);
+        set_header(block, adj_size, true);
+        ptrs[i] = incr_pointer(W_SIZE, block);
+        block = (block_t*)incr_pointer(adj_size, block);
+        block->header = PREV_ALLOC_BIT;
+        set_header(block, block_size - adj_size, true);
+    }
+    ptrs[n - 1] = incr_pointer(W_SIZE, block);
+    for (size_t i = 0; i < n; i++) {
+        check_touched((block_t*)decr_pointer(W_SIZE, ptrs[i]));
+    }
+    return n;
+}
+
+/* Removes the inputted free block, which ends the sbrk heap, and moves the break down
+ * past it. A check cursor on the block or the old epilogue moves to the new epilogue */
+static void trim_heap(block_t *top) {
+    block_remove(top);
+    if (mem_shrink(get_size(top)) < 0) {
+        block_append(top);
+        return;
+    }
+    mm_arena->heap_last = top;
+    top->header = ALLOC_BIT | PREV_ALLOC_BIT;
+    if (mm_arena->check_cursor >= top) {
+        mm_arena->check_cursor = top;
+    }
+}
+/* Decommits the pages under the payload of the inputted free block, other than the top,
+ * if it is large and was already idle the last time, and marks it idle */
+static void release_block(block_t *curr, block_t *top) {
+    if (get_size(curr) < DECOMMIT_THRESHOLD || curr == top || (curr->header & DECOMMITTED_BIT)) {
+        return;
+    }
+    if (curr->header & IDLE_BIT) {
+        // Keeps the links of whichever layout the block uses, of which size_payload is the largest
+        mem_decommit(incr_pointer(W_SIZE + sizeof(size_payload), curr),
+                     get_size(curr) - 2 * W_SIZE - sizeof(size_payload));
+        curr->header |= DECOMMITTED_BIT;
+    }
+    curr->header |= IDLE_BIT;
+    set_footer(curr);
+}
+// Calls release_block on the blocks of the inputted treap, skipping subtrees of small blocks
+static void release_tree(block_t *node, block_t *top) {
+    if (node != NULL && get_max_size(node) >= DECOMMIT_THRESHOLD) {
+        release_block(node, top);
+        release_tree(get_links(node)->left, top);
+        release_tree(get_links(node)->right, top);
+    }
+}
+/* Calls release_block on the blocks of the inputted size tree, skipping the subtrees of
+ * nodes too small to be decommitted */
+static void release_sizes(block_t *node, block_t *top) {
+    if (node == NULL) {
+        return;
+    }
+    if (get_size(node) >= DECOMMIT_THRESHOLD) {
+        for (block_t *curr = node; curr != NULL; curr = get_next(curr)) {
+            release_block(curr, top);
+        }
+        release_sizes(get_size_links(node)->left, top);
+    }
+    release_sizes(get_size_links(node)->right, top);
+}
+/* Gives the memory of the arena's large free blocks back once the quick bins are merged
+ * into them: trims the top of the sbrk heap, then releases every other large free block */
+static void release_memory() {
+    consolidate();
+    block_t *top = get_top();
+    bool is_sbrk_heap = true;
+#ifdef THREAD_SAFE
+    is_sbrk_heap = mm_arena == &mm_arenas[0];
+#endif
+    if (is_sbrk_heap && top != mm_arena->heap_last && get_size(top) >= TRIM_THRESHOLD) {
+        trim_heap(top);
+    }
+    uint64_t map = mm_arena->free_map & (~(uint64_t)0 << get_class(DECOMMIT_THRESHOLD));
+    for (; map != 0; map &= map - 1) {
+        block_t *curr = mm_arena->free_lists[__builtin_ctzl(map)];
+        if (LIST_ORDER == ADDRESS_ORDER) {
+            release_tree(curr, top);
+            continue;
+        }
+        if (is_tree_class(__builtin_ctzl(map))) {
+            release_sizes(curr, top);
+            continue;
+        }
+        for (; curr != NULL; curr = get_next(curr)) {
+            release_block(curr, top);
+        }
+    }
+}
+
+/* Frees the inputted pointer of the current arena. A non-zero size is the size it was
+ * allocated with, which rules out a run slot or a quick bin without looking it up */
+static void heap_free(void *ptr, size_t size) {
+    if (!mm_arena->heap_first) {
+        heap_init();
+    }
+    if (ptr == NULL) {
+        return;
+    }
+    if (size <= RUN_LIMIT && is_run_page(get_page(ptr))) {
+        // An emptied run may go back to the heap, so its block is checked first
+        check_touched(decr_pointer(W_SIZE, get_run(ptr)));
+        run_free(ptr);
+        return;
+    }
+    block_t *block = (block_t*)decr_pointer(W_SIZE, ptr);
+    if (is_quick_size(get_block_size(size)) && is_quick_size(get_size(block))) {
+        quick_push(block);
+    }
+    else {
+        block = free_block(block);
+    }
+    check_touched(block);
+    if (mm_arena->quick_count > QUICK_MAX) {
+        consolidate();
+    }
+    if (++mm_arena->num_frees % RELEASE_INTERVAL == 0) {
+        release_memory();
+    }
+}
+/* Resizes the inputted allocated block in place if it can be done without moving it:
+ * shrinking splits off the tail, and growing absorbs a free right neighbour, which for
+ * a block at the top of the heap is a wilderness block grown to fit. Returns whether
+ * the resize happened */
+static bool resize_in_place(block_t *block, size_t size) {
+    size_t block_size = get_size(block);
+    block_t *right = get_right(block);
+    if (block_size < size) {
+        size_t right_size = 0;
+        if (right != mm_arena->heap_last && !is_allocated(right)) {
+            right_size = get_size(right);
+        }
+        if (block_size + right_size < size) {
+            block_t *end = right_size ? get_right(right) : right;
+            if (end != mm_arena->heap_last) {
+                return false;
+            }
+            right = extend_heap(size - block_size - right_size);
+            if (right == NULL) {
+                return false;
+            }
+        }
+        if (right != mm_arena->heap_last && !is_allocated(right)) {
+            block_remove(right);
+            check_merged(right, block);
+            set_header(block, block_size + get_size(right), true);
+            set_prev_allocated(get_right(block), true);
+        }
+    }
+    shrink_block(block, size);
+    return true;
+}
+// Resizes the allocation at the inputted pointer in place, returning whether that was possible
+static bool heap_resize(void *ptr, size_t size) {
+    if (is_run_page(get_page(ptr))) {
+        return size <= get_run(ptr)->slot_size;
+    }
+    block_t *block = (block_t*)decr_pointer(W_SIZE, ptr);
+    if (!resize_in_place(block, get_block_size(size))) {
+        return false;
+    }
+    check_touched(block);
+    return true;
+}
+
+#ifdef THREAD_SAFE
+/* Returns the arena owning the inputted pointer: arena 0 below the break, and otherwise
+ * the arena named in the header of the aligned region holding it */
+static inline arena_t *get_arena(void *ptr) {
+    if (ptr <= mem_heap_hi()) {
+        return &mm_arenas[0];
+    }
+    return ((region_t*)((uintptr_t)ptr & ~(uintptr_t)(REGION_SIZE - 1)))->arena;
+}
+// Returns the calling thread's arena, handing arenas out round robin on first use
+static arena_t *get_home(void) {
+    if (mm_home == NULL) {
+        uint32_t next = __atomic_fetch_add(&mm_next_arena, 1, __ATOMIC_RELAXED);
+        mm_home = &mm_arenas[next % NUM_ARENAS];
+    }
+    return mm_home;
+}
+// Queues the inputted pointer on its arena's remote frees without taking the arena's lock
+static void remote_free(arena_t *arena, void *ptr) {
+    void *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, ptr, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+/* Locks the inputted arena for the heap functions and frees the pointers that other
+ * threads have queued on it since it was last entered */
+static void arena_enter(arena_t *arena) {
+    arena_lock(arena);
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) != NULL) {
+        void *ptr = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+        while (ptr != NULL) {
+            void *next = *(void**)ptr;
+            heap_free(ptr, 0);
+            ptr = next;
+        }
+    }
+}
+// Returns the cached pointers of the inputted thread cache to the thread's arena
+static void tcache_flush(tcache_t *tcache) {
+    arena_enter(get_home());
+    if (tcache->generation == mm_generation) {
+        for (size_t bin = 0; bin < TCACHE_BINS; bin++) {
+            while (tcache->bins[bin] != NULL) {
+                void *ptr = tcache->bins[bin];
+                tcache->bins[bin] = *(void**)ptr;
+                heap_free(ptr, 0);
+            }
+        }
+    }
+    arena_unlock();
+    memset(tcache, 0, sizeof(*tcache));
+}
+
+static void tcache_destroy(void *tcache) {
+    tcache_flush(tcache);
+    count_flush();
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&mm_tcache_key, tcache_destroy);
+}
+/* Returns the calling thread's cache, registering it to be flushed at thread exit on
+ * first use and emptying it if the heap has been reset since it was filled */
+static tcache_t *get_tcache(void) {
+    tcache_t *tcache = &mm_tcache;
+    uint64_t generation = __atomic_load_n(&mm_generation, __ATOMIC_ACQUIRE);
+    if (tcache->generation != generation) {
+        if (tcache->generation == 0) {
+            pthread_once(&mm_tcache_once, tcache_key_init);
+            pthread_setspecific(mm_tcache_key, tcache);
+        }
+        memset(tcache->bins, 0, sizeof(tcache->bins));
+        memset(tcache->counts, 0, sizeof(tcache->counts));
+        tcache->generation = generation;
+    }
+    return tcache;
+}
+// Allocates TCACHE_BATCH blocks for the inputted empty bin under one lock and returns one of them
+static void *tcache_refill(tcache_t *tcache, size_t bin) {
+    void *ptr;
+    arena_enter(get_home());
+    ptr = heap_malloc(bin * D_SIZE);
+    for (size_t i = 1; ptr != NULL && i < TCACHE_BATCH; i++) {
+        void *extra = heap_malloc(bin * D_SIZE);
+        if (extra == NULL) {
+            break;
+        }
+        *(void**)extra = tcache->bins[bin];
+        tcache->bins[bin] = extra;
+        tcache->counts[bin]++;
+    }
+    arena_unlock();
+    return ptr;
+}
+// Frees TCACHE_BATCH pointers of the inputted full bin under one lock
+static void tcache_drain(tcache_t *tcache, size_t bin) {
+    arena_enter(get_home());
+    for (size_t i = 0; i < TCACHE_BATCH; i++) {
+        void *ptr = tcache->bins[bin];
+        tcache->bins[bin] = *(void**)ptr;
+        heap_free(ptr, 0);
+    }
+    arena_unlock();
+    tcache->counts[bin] -= TCACHE_BATCH;
+}
+#endif
+/* Requests too large for a region of another arena fall back on arena 0 */
+static void *malloc_block(size_t size) {
+    if (too_large(size)) {
+        return NULL;
+    }
+    if (size >= HUGE_THRESHOLD) {
+        return huge_malloc(size);
+    }
+#ifdef THREAD_SAFE
+    size_t bin = round_up(size, D_SIZE) / D_SIZE;
+    if (size != 0 && bin < TCACHE_BINS) {
+        tcache_t *tcache = get_tcache();
+        void *ptr = tcache->bins[bin];
+        if (ptr == NULL) {
+            return tcache_refill(tcache, bin);
+        }
+        tcache->bins[bin] = *(void**)ptr;
+        tcache->counts[bin]--;
+        return ptr;
+    }
+#endif
+    arena_enter(get_home());
+    void *ptr = heap_malloc(size);
+    arena_unlock();
+#ifdef THREAD_SAFE
+    if (ptr == NULL && size != 0 && get_home() != &mm_arenas[0]) {
+        arena_enter(&mm_arenas[0]);
+        ptr = heap_malloc(size);
+        arena_unlock();
+    }
+#endif
+    return ptr;
+}
+/* Frees the inputted pointer of a heap block, allocated with the inputted size if non-zero.
+ * Pointers of another thread's arena go on that arena's remote frees rather than
+ * contending for its lock */
+static void free_heap(void *ptr, size_t size) {
+#ifdef THREAD_SAFE
+    arena_t *arena = get_arena(ptr);
+    if (arena != get_home()) {
+        remote_free(arena, ptr);
+        return;
+    }
+    size_t bin = usable_size(ptr) / D_SIZE;
+    if (bin < TCACHE_BINS) {
+        tcache_t *tcache = get_tcache();
+        if (tcache->counts[bin] == TCACHE_COUNT) {
+            tcache_drain(tcache, bin);
+        }
+        *(void**)ptr = tcache->bins[bin];
+        tcache->bins[bin] = ptr;
+        tcache->counts[bin]++;
+        return;
+    }
+#endif
+    arena_enter(get_home());
+    heap_free(ptr, size);
+    arena_unlock();
+}
+/* The heap profiler samples about one allocation per mm_prof_rate bytes allocated. Each
+ * thread counts the bytes it allocates down from a distance drawn from an exponential
+ * distribution of that mean, so that every byte is equally likely to be the one sampled,
+ * and the allocation that takes the count past zero is sampled: its call stack is counted
+ * in mm_prof_stacks, and the block, marked with SAMPLED_BIT, is kept in mm_prof_samples
+ * until it is freed. A thread sees a new rate within PROF_RECHECK bytes. Both tables are
+ * static and use open addressing; a sample that would fill one past 3/4 is dropped */
+#define PROF_DEPTH 32
+#define PROF_STACKS 4096
+#define PROF_SAMPLES 32768
+#define PROF_RECHECK ((size_t)1 << 20)
+
+typedef struct {
+    // hash is 0 for an unused entry; live counts what is still allocated, alloc everything sampled
+    uint64_t hash;
+    size_t depth;
+    size_t live_count;
+    size_t live_bytes;
+    size_t alloc_count;
+    size_t alloc_bytes;
+    void *pcs[PROF_DEPTH];
+} prof_stack_t;
+
+typedef struct {
+    // ptr is NULL for an unused entry, and size the size the block was requested with
+    void *ptr;
+    size_t size;
+    size_t stack;
+} prof_sample_t;
+
+typedef struct {
+    // The return addresses collected so far by an unwind, which starts at the frame of caller
+    void **pcs;
+    size_t depth;
+    void *caller;
+} prof_unwind_t;
+
+/* mm_prof_rate is 0 when sampling is off, and mm_prof_dump_rate the last rate that was not.
+ * mm_prof_live counts the entries of mm_prof_samples, which free reads without the lock */
+static size_t mm_prof_rate = 0;
+static size_t mm_prof_dump_rate = 0;
+static size_t mm_prof_live = 0;
+static size_t mm_prof_num_stacks = 0;
+static uint64_t mm_prof_seeds = 0;
+static prof_stack_t mm_prof_stacks[PROF_STACKS];
+static prof_sample_t mm_prof_samples[PROF_SAMPLES];
+/* Per thread: the bytes left until the next sample, the state of the random number
+ * generator, and whether the thread is inside the profiler, so as not to sample the
+ * allocations the unwinder or stdio may make */
+#ifdef THREAD_SAFE
+static pthread_mutex_t mm_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread size_t mm_prof_left;
+static __thread uint64_t mm_prof_seed;
+static __thread bool mm_prof_busy;
+# define prof_lock() pthread_mutex_lock(&mm_prof_lock)
+# define prof_unlock() pthread_mutex_unlock(&mm_prof_lock)
+#else
+static size_t mm_prof_left;
+static uint64_t mm_prof_seed;
+static bool mm_prof_busy;
+# define prof_lock()
+# define prof_unlock()
+#endif
+
+/* Counts the inputted number of allocated bytes down, returning whether they are due a
+ * sample. This is all an allocation that is not sampled costs */
+static inline bool prof_tick(size_t size) {
+    return __builtin_expect(__builtin_sub_overflow(mm_prof_left, size, &mm_prof_left), 0);
+}
+/* Returns a distance to the next sample, drawn from an exponential distribution of the
+ * inputted mean: -ln(u) * mean for u uniform in (0, 1]. ln is taken as the exponent of u
+ * times ln 2 plus a short series for the mantissa, to stay clear of libm */
+static size_t prof_interval(size_t mean) {
+    if (mm_prof_seed == 0) {
+        mm_prof_seed = ((uintptr_t)&mm_prof_seed ^
+            __atomic_add_fetch(&mm_prof_seeds, 0x9e3779b97f4a7c15, __ATOMIC_RELAXED)) | 1;
+    }
+    mm_prof_seed ^= mm_prof_seed << 13;
+    mm_prof_seed ^= mm_prof_seed >> 7;
+    mm_prof_seed ^= mm_prof_seed << 17;
+    // u is q / 2^53, and q = m * 2^e for m in [1, 2)
+    uint64_t q = (mm_prof_seed >> 11) + 1;
+    int e = 63 - __builtin_clzl(q);
+    double m = (double)q / (double)((uint64_t)1 << e);
+    double t = (m - 1) / (m + 1);
+    double t2 = t * t;
+    double ln_m = 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+    double neg_ln_u = (53 - e) * 0.6931471805599453 - ln_m;
+    return (size_t)(neg_ln_u * (double)mean) + 1;
+}
+
+static _Unwind_Reason_Code prof_frame(struct _Unwind_Context *context, void *arg) {
+    prof_unwind_t *unwind = arg;
+    void *pc = (void*)_Unwind_GetIP(context);
+    if (pc == NULL) {
+        return _URC_END_OF_STACK;
+    }
+    if (unwind->caller != NULL) {
+        if (pc != unwind->caller) {
+            return _URC_NO_REASON;
+        }
+        unwind->caller = NULL;
+    }
+    unwind->pcs[unwind->depth++] = pc;
+    return unwind->depth == PROF_DEPTH ? _URC_END_OF_STACK : _URC_NO_REASON;
+}
+
+static inline size_t prof_slot(void *ptr) {
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15 >> 32) % PROF_SAMPLES;
+}
+/* Returns the entry of the inputted stack in mm_prof_stacks, adding it if it is new, or
+ * NULL if the table is too full to add it; called with mm_prof_lock held */
+static prof_stack_t *prof_find_stack(void **pcs, size_t depth) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3;
+    }
+    hash |= 1;
+    size_t i = hash % PROF_STACKS;
+    while (mm_prof_stacks[i].hash != 0) {
+        prof_stack_t *stack = &mm_prof_stacks[i];
+        if (stack->hash == hash && stack->depth == depth &&
+                memcmp(stack->pcs, pcs, depth * sizeof(void*)) == 0) {
+            return stack;
+        }
+        i = (i + 1) % PROF_STACKS;
+    }
+    if (mm_prof_num_stacks >= PROF_STACKS / 4 * 3) {
+        return NULL;
+    }
+    mm_prof_num_stacks++;
+    mm_prof_stacks[i].hash = hash;
+    mm_prof_stacks[i].depth = depth;
+    memcpy(mm_prof_stacks[i].pcs, pcs, depth * sizeof(void*));
+    return &mm_prof_stacks[i];
+}
+/* Empties entry i of mm_prof_samples, moving later entries of its probe sequence back
+ * so that none is left behind the gap; called with mm_prof_lock held */
+static void prof_remove_sample(size_t i) {
+    for (size_t j = (i + 1) % PROF_SAMPLES; mm_prof_samples[j].ptr != NULL; j = (j + 1) % PROF_SAMPLES) {
+        size_t home = prof_slot(mm_prof_samples[j].ptr);
+        // The entry at j may move to i unless its home lies cyclically in (i, j]
+        if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            mm_prof_samples[i] = mm_prof_samples[j];
+            i = j;
+        }
+    }
+    mm_prof_samples[i].ptr = NULL;
+    __atomic_store_n(&mm_prof_live, mm_prof_live - 1, __ATOMIC_RELAXED);
+}
+// Sets or clears SAMPLED_BIT of the inputted allocation, under the lock of its arena
+static void set_sampled(void *ptr, bool sampled) {
+    block_t *block = (block_t*)decr_pointer(W_SIZE, ptr);
+    bool huge = is_huge(ptr);
+    if (!huge) {
+        arena_lock(get_arena(ptr));
+    }
+    if (sampled) {
+        block->header |= SAMPLED_BIT;
+    }
+    else {
+        block->header &= ~SAMPLED_BIT;
+    }
+    if (!huge) {
+        arena_unlock();
+    }
+}
+/* Enters the inputted allocation of the inputted size into the profile as live, under the
+ * profile lock, as a sample of the inputted stack */
+static void prof_insert(void *ptr, size_t size, size_t stack) {
+    size_t i = prof_slot(ptr);
+    while (mm_prof_samples[i].ptr != NULL) {
+        i = (i + 1) % PROF_SAMPLES;
+    }
+    mm_prof_samples[i].ptr = ptr;
+    mm_prof_samples[i].size = size;
+    mm_prof_samples[i].stack = stack;
+    __atomic_store_n(&mm_prof_live, mm_prof_live + 1, __ATOMIC_RELAXED);
+    mm_prof_stacks[stack].live_count++;
+    mm_prof_stacks[stack].live_bytes += size;
+}
+/* Returns whether the inputted allocation has been sampled. Run slots never are: their
+ * allocations are moved to a block of their own to be sampled */
+static inline bool is_sampled(void *ptr) {
+    block_t *block = (block_t*)decr_pointer(W_SIZE, ptr);
+    if (!is_huge(ptr) && is_run_page(get_page(ptr))) {
+        return false;
+    }
+    return __atomic_load_n(&block->header, __ATOMIC_RELAXED) & SAMPLED_BIT;
+}
+/* Samples the inputted allocation of the inputted size, which made prof_tick fire, and
+ * draws the distance to the next sample. Returns the allocation, which a run slot leaves
+ * for a block of its own. The stack recorded starts at the inputted return address of the
+ * allocation function, the frames above it being the allocator's own; should the unwinder
+ * not find it, the whole stack is kept */
+static __attribute__((noinline)) void *prof_sample(void *ptr, size_t size, void *caller) {
+    size_t rate = __atomic_load_n(&mm_prof_rate, __ATOMIC_RELAXED);
+    mm_prof_left = rate != 0 ? prof_interval(rate) : PROF_RECHECK;
+    if (rate == 0 || ptr == NULL || mm_prof_busy) {
+        return ptr;
+    }
+    mm_prof_busy = true;
+    void *pcs[PROF_DEPTH];
+    prof_unwind_t unwind = { .pcs = pcs, .depth = 0, .caller = caller };
+    _Unwind_Backtrace(prof_frame, &unwind);
+    if (unwind.caller != NULL) {
+        unwind.caller = NULL;
+        _Unwind_Backtrace(prof_frame, &unwind);
+    }
+
+    // A run slot has no header to mark, so its allocation moves to a block that does
+    if (!is_huge(ptr) && is_run_page(get_page(ptr))) {
+        void *moved = malloc_block(RUN_LIMIT + 1);
+        if (moved == NULL) {
+            mm_prof_busy = false;
+            return ptr;
+        }
+        memcpy(moved, ptr, usable_size(ptr));
+        free_heap(ptr, 0);
+        ptr = moved;
+    }
+    prof_lock();
+    prof_stack_t *stack = prof_find_stack(pcs, unwind.depth);
+    bool recorded = stack != NULL && mm_prof_live < PROF_SAMPLES / 4 * 3;
+    if (recorded) {
+        prof_insert(ptr, size, (size_t)(stack - mm_prof_stacks));
+        stack->alloc_count++;
+        stack->alloc_bytes += size;
+    }
+    prof_unlock();
+    if (recorded) {
+        set_sampled(ptr, true);
+    }
+    mm_prof_busy = false;
+    return ptr;
+}
+/* Removes the inputted sampled allocation, which is being freed or resized, from the profile.
+ * Returns its entry, whose ptr is NULL if it was not found */
+static prof_sample_t prof_forget(void *ptr) {
+    prof_sample_t sample = { .ptr = NULL };
+    set_sampled(ptr, false);
+    prof_lock();
+    for (size_t i = prof_slot(ptr); mm_prof_samples[i].ptr != NULL; i = (i + 1) % PROF_SAMPLES) {
+        if (mm_prof_samples[i].ptr == ptr) {
+            sample = mm_prof_samples[i];
+            prof_stack_t *stack = &mm_prof_stacks[sample.stack];
+            stack->live_count--;
+            stack->live_bytes -= sample.size;
+            prof_remove_sample(i);
+            break;
+        }
+    }
+    prof_unlock();
+    return sample;
+}
+/* Forgets the inputted allocation if it was sampled, returning its entry as prof_forget does.
+ * Checking costs a single load while no sample is live */
+static inline prof_sample_t prof_release(void *ptr) {
+    if (__builtin_expect(__atomic_load_n(&mm_prof_live, __ATOMIC_RELAXED) != 0, 0) && is_sampled(ptr)) {
+        return prof_forget(ptr);
+    }
+    return (prof_sample_t){ .ptr = NULL };
+}
+/* Puts back the inputted entry that prof_release returned, for an allocation that stayed
+ * live after all */
+static void prof_restore(prof_sample_t sample) {
+    if (sample.ptr == NULL) {
+        return;
+    }
+    prof_lock();
+    prof_insert(sample.ptr, sample.size, sample.stack);
+    prof_unlock();
+    set_sampled(sample.ptr, true);
+}
+/* Empties the profile, whose blocks mm_init is about to discard with the heap. The tables
+ * are only cleared when a sample has been taken, since they are larger than the L2 cache */
+static void prof_reset(void) {
+    prof_lock();
+    if (mm_prof_num_stacks != 0) {
+        memset(mm_prof_stacks, 0, sizeof(mm_prof_stacks));
+        memset(mm_prof_samples, 0, sizeof(mm_prof_samples));
+        mm_prof_num_stacks = 0;
+        __atomic_store_n(&mm_prof_live, 0, __ATOMIC_RELAXED);
+    }
+    prof_unlock();
+}
+#ifdef THREAD_SAFE
+/* Holds every lock of the heap across a fork, so that the child, left with only the forking
+ * thread, cannot find one held by a thread it does not have */
+static void fork_prepare(void) {
+    prof_lock();
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        pthread_mutex_lock(&mm_arenas[i].lock);
+    }
+}
+
+static void fork_release(void) {
+    for (size_t i = NUM_ARENAS; i-- > 0;) {
+        pthread_mutex_unlock(&mm_arenas[i].lock);
+    }
+    prof_unlock();
+}
+
+static __attribute__((constructor)) void fork_init(void) {
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+#endif
+/* Allocates a block for a payload of the inputted size */
+void *malloc(size_t size) {
+    count_calls(COUNT_MALLOC, 1);
+    void *ptr = malloc_block(size);
+    if (prof_tick(size)) {
+        ptr = prof_sample(ptr, size, __builtin_return_address(0));
+    }
+    return ptr;
+}
+// Checks in debug builds that the inputted size fits the allocation at the inputted pointer
+static inline void check_size(void *ptr, size_t size) {
+#ifdef DEBUG
+    assert(usable_size(ptr) >= size && is_huge(ptr) == (size >= HUGE_THRESHOLD));
+#else
+    (void)ptr;
+    (void)size;
+#endif
+}
+
+// Frees the inputted allocation, huge or of a heap
+static void free_ptr(void *ptr) {
+    prof_release(ptr);
+    if (is_huge(ptr)) {
+        huge_free(ptr);
+        return;
+    }
+    free_heap(ptr, 0);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    count_calls(COUNT_FREE, 1);
+    free_ptr(ptr);
+}
+/* Frees the inputted pointer, which malloc, calloc or realloc returned for the inputted
+ * size. The size alone tells a huge block from a heap block, and rules out a run slot
+ * or a quick bin for larger sizes; a size of 0 is taken as unknown */
+void free_sized(void *ptr, size_t size) {
+    if (ptr == NULL || size == 0) {
+        free(ptr);
+        return;
+    }
+    check_size(ptr, size);
+    count_calls(COUNT_FREE, 1);
+    prof_release(ptr);
+    if (size >= HUGE_THRESHOLD) {
+        huge_free(ptr);
+        return;
+    }
+    free_heap(ptr, size);
+}
+/* Changes the size of the block in place when possible, or by remapping a huge block
+ * staying huge, and otherwise by mallocing a new block, copying its data, and freeing
+ * the old block. A block growing to a huge size moves out of the heap */
+static void *realloc_block(void *old_ptr, size_t size) {
+    if (too_large(size)) {
+        return NULL;
+    }
+    if (is_huge(old_ptr)) {
+        if (size >= HUGE_THRESHOLD) {
+            void *new_ptr = huge_realloc(old_ptr, size);
+            if (new_ptr) {
+                count_calls(COUNT_IN_PLACE, 1);
+            }
+            return new_ptr;
+        }
+    }
+    else if (size < HUGE_THRESHOLD) {
+        arena_enter(get_arena(old_ptr));
+        bool resized = heap_resize(old_ptr, size);
+        arena_unlock();
+        if (resized) {
+            count_calls(COUNT_IN_PLACE, 1);
+            return old_ptr;
+        }
+    }
+    size_t old_size = usable_size(old_ptr);
+    void *new_ptr = malloc_block(size);
+    if (!new_ptr) {
+        return NULL;
+    }
+    if (size < old_size) {
+        old_size = size;
+    }
+    copy_payload(new_ptr, old_ptr, old_size);
+    free_ptr(old_ptr);
+    count_calls(COUNT_COPIED, 1);
+    return new_ptr;
+}
+/* A resized block counts as a new allocation of its new size for the heap profile, and
+ * one that was sampled leaves the profile first, to be put back if the resize fails */
+void *realloc(void *old_ptr, size_t size) {
+    if (size == 0) {
+        free(old_ptr);
+        return NULL;
+    }
+    if (!old_ptr) {
+        return malloc(size);
+    }
+    count_calls(COUNT_REALLOC, 1);
+    prof_sample_t sample = prof_release(old_ptr);
+    void *ptr = realloc_block(old_ptr, size);
+    if (ptr == NULL) {
+        prof_restore(sample);
+    }
+    if (prof_tick(size)) {
+        ptr = prof_sample(ptr, size, __builtin_return_address(0));
+    }
+    return ptr;
+}
+/* Allocates a block of the inputted number of bytes and sets it to zero. A huge block is
+ * a fresh mapping, already zero, and space just taken from the untouched top of the heap
+ * needs only the words the heap wrote in it cleared */
+static void *calloc_block(size_t bytes) {
+    if (too_large(bytes)) {
+        return NULL;
+    }
+    if (bytes >= HUGE_THRESHOLD) {
+        return huge_malloc(bytes);
+    }
+    if (bytes <= RUN_LIMIT) {
+        void *new_ptr = malloc_block(bytes);
+        /* If malloc() fails, skip zeroing out the memory. */
+        if (new_ptr) {
+            memset(new_ptr, 0, bytes);
+        }
+        return new_ptr;
+    }
+    arena_enter(get_home());
+    void *ptr = heap_calloc(bytes);
+    arena_unlock();
+#ifdef THREAD_SAFE
+    if (ptr == NULL && get_home() != &mm_arenas[0]) {
+        arena_enter(&mm_arenas[0]);
+        ptr = heap_calloc(bytes);
+        arena_unlock();
+    }
+#endif
+    return ptr;
+}
+// Allocates a zeroed block for nmemb * size bytes, failing with ENOMEM if that overflows
+void *calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t bytes = nmemb * size;
+    count_calls(COUNT_MALLOC, 1);
+    void *ptr = calloc_block(bytes);
+    if (prof_tick(bytes)) {
+        ptr = prof_sample(ptr, bytes, __builtin_return_address(0));
+    }
+    return ptr;
+}
+/* Allocates n blocks for payloads of the inputted size, storing them in ptrs, and returns
+ * how many it allocated, fewer than n only when out of memory. The blocks are carved one
+ * after another from a single fit, under one lock, or else allocated one at a time. Each
+ * may be freed on its own */
+size_t malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t count = 0;
+    if (size == 0) {
+        return 0;
+    }
+    if (size < HUGE_THRESHOLD && n != 0 && n <= (SIZE_MAX >> 2) / get_block_size(size)) {
+        arena_enter(get_home());
+        count = heap_malloc_batch(size, n, ptrs);
+        arena_unlock();
+    }
+    while (count < n && (ptrs[count] = malloc_block(size)) != NULL) {
+        count++;
+    }
+    count_calls(COUNT_MALLOC, count);
+    // The whole batch counts towards the next sample, which falls on its first block
+    if (count != 0 && prof_tick(size * count)) {
+        ptrs[0] = prof_sample(ptrs[0], size, __builtin_return_address(0));
+    }
+    return count;
+}
+/* Frees the n pointers in ptrs, which were all allocated for payloads of the inputted size,
+ * under one lock. NULL pointers are skipped */
+void free_batch(void **ptrs, size_t n, size_t size) {
+    if (size == 0 || size >= HUGE_THRESHOLD) {
+        for (size_t i = 0; i < n; i++) {
+            free_sized(ptrs[i], size);
+        }
+        return;
+    }
+    size_t num_freed = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            prof_release(ptrs[i]);
+            num_freed++;
+        }
+    }
+    count_calls(COUNT_FREE, num_freed);
+    arena_enter(get_home());
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+        check_size(ptrs[i], size);
+#ifdef THREAD_SAFE
+        arena_t *arena = get_arena(ptrs[i]);
+        if (arena != mm_arena) {
+            remote_free(arena, ptrs[i]);
+            continue;
+        }
+#endif
+        heap_free(ptrs[i], size);
+    }
+    arena_unlock();
+}
+/* Allocates a block aligned to the inputted alignment, rounded up to a power of two. Any
+ * alignment beyond 16 bytes is carved from an arena, even for sizes that malloc would map on
+ * their own, since the payload of a huge block always sits D_SIZE bytes into its page */
+static void *memalign_block(size_t alignment, size_t size) {
+    if (alignment <= D_SIZE) {
+        return malloc_block(size);
+    }
+    if (alignment > (SIZE_MAX >> 2) || size > (SIZE_MAX >> 2)) {
+        return NULL;
+    }
+    if ((alignment & (alignment - 1)) != 0) {
+        alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+    }
+    arena_enter(get_home());
+    void *ptr = heap_memalign(size, alignment);
+    arena_unlock();
+#ifdef THREAD_SAFE
+    if (ptr == NULL && size != 0 && get_home() != &mm_arenas[0]) {
+        arena_enter(&mm_arenas[0]);
+        ptr = heap_memalign(size, alignment);
+        arena_unlock();
+    }
+#endif
+    return ptr;
+}
+// Allocates a block aligned to the inputted alignment, as memalign_block does
+void *memalign(size_t alignment, size_t size) {
+    count_calls(COUNT_MALLOC, 1);
+    void *ptr = memalign_block(alignment, size);
+    if (prof_tick(size)) {
+        ptr = prof_sample(ptr, size, __builtin_return_address(0));
+    }
+    return ptr;
+}
+/* Stores a block aligned to the inputted alignment in *memptr, returning EINVAL for an
+ * alignment that is not a power of two multiple of the size of a pointer */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    void *ptr = memalign(alignment, size);
+    if (ptr == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+// Allocates a block aligned to the inputted alignment, which must be a power of two
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+// Allocates a block aligned to a page
+void *valloc(size_t size) {
+    return memalign(mem_pagesize(), size);
+}
+// Allocates a block aligned to a page, of the inputted size rounded up to whole pages
+void *pvalloc(size_t size) {
+    size_t page = mem_pagesize();
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, size == 0 ? page : round_up(size, page));
+}
+// Resizes the inputted block to nmemb elements of the inputted size, failing on overflow
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+// Frees a block of aligned_alloc; its alignment and size are not needed to find it
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+    (void)alignment;
+    (void)size;
+    free(ptr);
+}
+// Returns the number of bytes usable at the inputted allocated pointer, or 0 for NULL
+size_t malloc_usable_size(void *ptr) {
+    return ptr == NULL ? 0 : usable_size(ptr);
+}
+/* Called when a new trace starts - pads heap and (re)initializes globals. Arenas other
+ * than arena 0 are emptied and map a region again on first use, and the heap profile
+ * and statistics start over */
+int mm_init(void) {
+    int result = 0;
+    memset(mm_run_pages, 0, sizeof(mm_run_pages));
+    prof_reset();
+    for (size_t i = 0; i < NUM_COUNTS; i++) {
+        __atomic_store_n(&mm_counts[i], 0, __ATOMIC_RELAXED);
+    }
+#ifdef THREAD_SAFE
+    memset(mm_local_counts, 0, sizeof(mm_local_counts));
+    mm_local_calls = 0;
+#endif
+    __atomic_store_n(&mm_huge_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mm_check_arena, 0, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        arena_lock(&mm_arenas[i]);
+#ifdef THREAD_SAFE
+        mm_arena->remote_frees = NULL;
+        mm_arena->heap_first = NULL;
+#endif
+        if (i == 0) {
+            result = heap_init();
+        }
+        arena_unlock();
+    }
+#ifdef THREAD_SAFE
+    __atomic_store_n(&mm_generation, mm_generation + 1, __ATOMIC_RELEASE);
+#endif
+    return result;
+}
+/* Checks the blocks from the inputted prologue up to the epilogue ending its heap and
+ * returns how many of them are free */
+static int64_t check_blocks(block_t *first, int verbose) {
+    block_t *curr = incr_pointer(D_SIZE, first);
+    int64_t num_free_check = 0;
+    if (!is_prev_allocated(curr)) {
+        printf("Error: previous-allocated bit does not match left block. Line %d", verbose);
+    }
+    for (; get_size(curr) != 0; curr = get_right(curr)) {
+        num_free_check += !is_allocated(curr);
+        if (!check_block(curr, verbose)) {
+            return num_free_check;
+        }
+    }
+    if (!is_allocated(curr)) {
+        printf("Error: epilogue is not marked allocated. Line %d", verbose);
+    }
+    return num_free_check;
+}
+// Checks the inputted block, found in the free list of the inputted class
+static void check_free_block(block_t *curr, size_t class, int verbose) {
+    if (!in_arena(curr)) {
+        printf("Error: free block outside of heap boundaries. Line %d", verbose);
+    }
+    if (get_class(get_size(curr)) != class) {
+        printf("Error: free block stored in the wrong size class. Line %d", verbose);
+    }
+    if (is_allocated(curr)) {
+        printf("Error: allocated block stored in a free list. Line %d", verbose);
+    }
+    if (!(mm_arena->free_map & ((uint64_t)1 << class))) {
+        printf("Error: non-empty size class missing from free map. Line %d", verbose);
+    }
+}
+/* Checks the treap of the inputted class rooted at the inputted node, whose blocks must all
+ * lie strictly between lo and hi (either NULL when unbounded), and returns its number of blocks */
+static int64_t check_tree(block_t *node, block_t *lo, block_t *hi, size_t class, int verbose) {
+    if (node == NULL) {
+        return 0;
+    }
+    block_t *left = get_links(node)->left;
+    block_t *right = get_links(node)->right;
+    check_free_block(node, class, verbose);
+    if ((lo != NULL && node <= lo) || (hi != NULL && node >= hi)) {
+        printf("Error: free block out of address order. Line %d", verbose);
+        return 1;
+    }
+    if ((left != NULL && get_priority(left) > get_priority(node)) ||
+        (right != NULL && get_priority(right) > get_priority(node))) {
+        printf("Error: treap child has a higher priority than its parent. Line %d", verbose);
+    }
+    size_t max_size = get_max_size(node);
+    tree_update(node);
+    if (get_max_size(node) != max_size) {
+        printf("Error: max size does not match the subtree. Line %d", verbose);
+    }
+    return 1 + check_tree(left, lo, node, class, verbose) + check_tree(right, node, hi, class, verbose);
+}
+/* Checks the size tree of the inputted class rooted at the inputted node, whose sizes must
+ * all lie strictly between lo and hi, with the lists behind its nodes, and returns its number
+ * of blocks */
+static int64_t check_sizes(block_t *node, size_t lo, size_t hi, size_t class, int verbose) {
+    if (node == NULL) {
+        return 0;
+    }
+    block_t *left = get_size_links(node)->left;
+    block_t *right = get_size_links(node)->right;
+    if (get_size(node) <= lo || get_size(node) >= hi) {
+        printf("Error: size tree node out of size order. Line %d", verbose);
+        return 1;
+    }
+    if ((left != NULL && get_size_priority(left) > get_size_priority(node)) ||
+        (right != NULL && get_size_priority(right) > get_size_priority(node))) {
+        printf("Error: size tree child has a higher priority than its parent. Line %d", verbose);
+    }
+    int64_t num_blocks = 0;
+    block_t *prev = NULL;
+    for (block_t *curr = node; curr != NULL; curr = get_next(curr)) {
+        if (get_prev(curr) != prev || get_size(curr) != get_size(node)) {
+            printf("Error: list behind a size tree node is inconsistent. Line %d", verbose);
+        }
+        check_free_block(curr, class, verbose);
+        num_blocks++;
+        prev = curr;
+    }
+    return num_blocks + check_sizes(left, lo, get_size(node), class, verbose) +
+        check_sizes(right, get_size(node), hi, class, verbose);
+}
+// Checks the heap, runs and free lists of the current arena
+static void check_arena(int verbose) {
+    int64_t num_free_check = 0;
+#ifdef THREAD_SAFE
+    if (mm_arena != &mm_arenas[0]) {
+        for (region_t *region = mm_arena->regions; region != NULL; region = region->next) {
+            if (region->arena != mm_arena) {
+                printf("Error: region header names another arena. Line %d", verbose);
+            }
+            num_free_check += check_blocks(incr_pointer(sizeof(region_t) + W_SIZE, region), verbose);
+        }
+        if (pointer_dif(mm_arena->region_end, mm_arena->heap_last) < D_SIZE) {
+            printf("Error: epilogue has been moved. Line %d", verbose);
+        }
+    }
+    else
+#endif
+    {
+        void *heap_lo = mem_heap_lo();
+        void *heap_hi = mem_heap_hi();
+        if ((void*)mm_arena->heap_first != heap_lo + W_SIZE) {
+            printf("Error: prologue has been moved. Line %d", verbose);
+        }
+        if ((void*)mm_arena->heap_last != decr_pointer(D_SIZE - 1 ,heap_hi)) {
+            printf("Error: epilogue has been moved. Line %d", verbose);
+        }
+        num_free_check += check_blocks(mm_arena->heap_first, verbose);
+    }
+    size_t quick_count = 0;
+    for (size_t bin = 0; bin < NUM_QUICK_BINS; bin++) {
+        for (block_t *curr = mm_arena->quick_bins[bin]; curr != NULL; curr = get_next(curr)) {
+            if (!is_allocated(curr) || get_size(curr) != bin * D_SIZE) {
+                printf("Error: block stored in the wrong quick bin. Line %d", verbose);
+            }
+            quick_count++;
+        }
+    }
+    if (quick_count != mm_arena->quick_count) {
+        printf("Error: quick bin count does not match its bins. Line %d", verbose);
+    }
+    for (size_t class = 0; class < NUM_RUN_CLASSES; class++) {
+        run_t *prev_run = NULL;
+        for (run_t *run = mm_arena->runs[class]; run != NULL; run = run->next) {
+            if (run->prev != prev_run || run->num_free == 0) {
+                printf("Error: run list is inconsistent. Line %d", verbose);
+            }
+            if (!is_run_page(get_page(run)) || run->slot_size != (class + 1) * D_SIZE) {
+                printf("Error: run stored in the wrong list. Line %d", verbose);
+            }
+            prev_run = run;
+        }
+    }
+    for (size_t class = 0; class < NUM_CLASSES; class++) {
+        if (mm_arena->free_lists[class] == NULL && (mm_arena->free_map & ((uint64_t)1 << class))) {
+            printf("Error: empty size class marked in free map. Line %d", verbose);
+        }
+        block_t *curr = mm_arena->free_lists[class];
+        block_t *prev = NULL;
+        int64_t class_count = 0;
+        if (LIST_ORDER == ADDRESS_ORDER) {
+            class_count = check_tree(curr, NULL, NULL, class, verbose);
+        }
+        else if (is_tree_class(class)) {
+            class_count = check_sizes(curr, 0, SIZE_MAX, class, verbose);
+        }
+        else {
+            for (; curr != NULL; curr = get_next(curr)) {
+                if (get_prev(curr) != prev) {
+                    printf("Error: prev of curr not matched with next of prev. Line %d", verbose);
+                }
+                check_free_block(curr, class, verbose);
+                class_count++;
+                prev = curr;
+            }
+        }
+        if ((size_t)class_count != mm_arena->free_counts[class]) {
+            printf("Error: free count of a size class does not match its list. Line %d", verbose);
+        }
+        num_free_check -= class_count;
+    }
+    if (num_free_check < 0) {
+        printf("Error: free list storing more blocks than are freed. Line %d", verbose);
+    }
+    else if (num_free_check > 0) {
+        printf("Error: not all free blocks are being stored in list. Line %d", verbose);
+    }
+}
+/* Calls the inputted visit function on the blocks from the inputted prologue up to the
+ * epilogue ending its heap */
+static void walk_blocks(block_t *first, mm_visit_t visit, void *arg) {
+    for (block_t *curr = incr_pointer(D_SIZE, first); get_size(curr) != 0; curr = get_right(curr)) {
+        visit(curr, get_size(curr), is_allocated(curr), arg);
+    }
+}
+// Calls the inputted visit function on every block of every arena
+void mm_heapwalk(mm_visit_t visit, void *arg) {
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        arena_lock(&mm_arenas[i]);
+        if (mm_arena->heap_first != NULL) {
+#ifdef THREAD_SAFE
+            if (mm_arena != &mm_arenas[0]) {
+                for (region_t *region = mm_arena->regions; region != NULL; region = region->next) {
+                    walk_blocks(incr_pointer(sizeof(region_t) + W_SIZE, region), visit, arg);
+                }
+            }
+            else
+#endif
+            walk_blocks(mm_arena->heap_first, visit, arg);
+        }
+        arena_unlock();
+    }
+}
+/* Fills in the inputted statistics, reading the counters of each arena under its lock.
+ * The calling thread's calls are all counted, but up to COUNT_FLUSH - 1 calls of each other
+ * thread may not be yet */
+void mm_heapstats(mm_heapstats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef THREAD_SAFE
+    count_flush();
+#endif
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        arena_lock(&mm_arenas[i]);
+        if (mm_arena->heap_first != NULL) {
+#ifdef THREAD_SAFE
+            if (mm_arena != &mm_arenas[0]) {
+                for (region_t *region = mm_arena->regions; region != NULL; region = region->next) {
+                    stats->heap_bytes += REGION_SIZE;
+                }
+            }
+            else
+#endif
+            stats->heap_bytes += mem_heapsize();
+            stats->free_bytes += mm_arena->free_bytes + mm_arena->quick_bytes;
+            stats->quick_blocks += mm_arena->quick_count;
+            for (size_t class = 0; class < NUM_CLASSES; class++) {
+                stats->free_blocks[class] += mm_arena->free_counts[class];
+            }
+            stats->sbrks += mm_arena->sbrks;
+        }
+        arena_unlock();
+    }
+    stats->huge_bytes = __atomic_load_n(&mm_huge_bytes, __ATOMIC_RELAXED);
+    stats->heap_bytes += stats->huge_bytes;
+    stats->in_use_bytes = stats->heap_bytes - stats->free_bytes;
+    stats->num_classes = NUM_CLASSES;
+    stats->mallocs = __atomic_load_n(&mm_counts[COUNT_MALLOC], __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&mm_counts[COUNT_FREE], __ATOMIC_RELAXED);
+    stats->reallocs = __atomic_load_n(&mm_counts[COUNT_REALLOC], __ATOMIC_RELAXED);
+    stats->reallocs_in_place = __atomic_load_n(&mm_counts[COUNT_IN_PLACE], __ATOMIC_RELAXED);
+    stats->reallocs_copied = __atomic_load_n(&mm_counts[COUNT_COPIED], __ATOMIC_RELAXED);
+}
+/* Samples about one allocation per the inputted number of bytes allocated for the heap
+ * profile, or stops sampling when it is 0. Samples already taken stay until freed */
+void mm_profile_start(size_t sample_bytes) {
+    prof_lock();
+    if (sample_bytes != 0) {
+        mm_prof_dump_rate = sample_bytes;
+    }
+    __atomic_store_n(&mm_prof_rate, sample_bytes, __ATOMIC_RELAXED);
+    prof_unlock();
+    mm_prof_left = sample_bytes != 0 ? prof_interval(sample_bytes) : PROF_RECHECK;
+}
+/* Writes the heap profile to the inputted file in the legacy text format of pprof: a line
+ * of totals, one line per sampled stack with its live samples and bytes and, in brackets,
+ * all it has had sampled, then the memory map pprof needs to symbolize the addresses. The
+ * counts are those sampled, and pprof scales them by the rate in the first line. Returns 0,
+ * or -1 if writing failed */
+int mm_profile_dump(FILE *out) {
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    bool busy = mm_prof_busy;
+    mm_prof_busy = true;
+    prof_lock();
+    for (size_t i = 0; i < PROF_STACKS; i++) {
+        live_count += mm_prof_stacks[i].live_count;
+        live_bytes += mm_prof_stacks[i].live_bytes;
+        alloc_count += mm_prof_stacks[i].alloc_count;
+        alloc_bytes += mm_prof_stacks[i].alloc_bytes;
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_count, live_bytes,
+            alloc_count, alloc_bytes, mm_prof_dump_rate);
+    for (size_t i = 0; i < PROF_STACKS; i++) {
+        prof_stack_t *stack = &mm_prof_stacks[i];
+        if (stack->hash == 0) {
+            continue;
+        }
+        fprintf(out, "%zu: %zu [%zu: %zu] @", stack->live_count, stack->live_bytes,
+                stack->alloc_count, stack->alloc_bytes);
+        for (size_t j = 0; j < stack->depth; j++) {
+            fprintf(out, " %p", stack->pcs[j]);
+        }
+        fprintf(out, "\n");
+    }
+    prof_unlock();
+
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(maps, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, (size_t)len, out);
+        }
+        close(maps);
+    }
+    mm_prof_busy = busy;
+    return (fflush(out) != 0 || ferror(out)) ? -1 : 0;
+}
+/* Checks up to the inputted number of blocks of the current arena from its check cursor on,
+ * leaving the cursor on the block after them, and returns how many it checked. Reaching the
+ * end of the heap ends the pass, and the cursor goes back to NULL */
+static size_t check_window(size_t num_blocks, int verbose) {
+    block_t *curr = mm_arena->check_cursor;
+    if (curr == NULL) {
+        curr = incr_pointer(D_SIZE, mm_arena->heap_first);
+#ifdef THREAD_SAFE
+        if (mm_arena != &mm_arenas[0]) {
+            curr = incr_pointer(sizeof(region_t) + W_SIZE + D_SIZE, mm_arena->regions);
+        }
+#endif
+        if (!is_prev_allocated(curr)) {
+            printf("Error: previous-allocated bit does not match left block. Line %d", verbose);
+        }
+    }
+    size_t num_checked = 0;
+    while (num_checked < num_blocks) {
+        if (get_size(curr) == 0) {
+            if (!is_allocated(curr)) {
+                printf("Error: epilogue is not marked allocated. Line %d", verbose);
+            }
+#ifdef THREAD_SAFE
+            // The regions of other arenas are walked from the newest, each ending in an epilogue
+            region_t *region = (region_t*)((uintptr_t)curr & ~(REGION_SIZE - 1));
+            if (mm_arena != &mm_arenas[0] && region->next != NULL) {
+                curr = incr_pointer(sizeof(region_t) + W_SIZE + D_SIZE, region->next);
+                continue;
+            }
+#endif
+            curr = NULL;
+            break;
+        }
+        num_checked++;
+        if (!check_block(curr, verbose)) {
+            curr = NULL;
+            break;
+        }
+        curr = get_right(curr);
+    }
+    mm_arena->check_cursor = curr;
+    return num_checked;
+}
+/* Checks up to the inputted number of blocks, resuming where the last call stopped, arena
+ * after arena, and returns how many it checked */
+size_t mm_checkheap_window(size_t num_blocks, int verbose) {
+    size_t num_checked = 0;
+    for (size_t tries = 0; tries < NUM_ARENAS && num_checked < num_blocks; tries++) {
+        size_t i = __atomic_load_n(&mm_check_arena, __ATOMIC_RELAXED);
+        bool is_done = true;
+        arena_lock(&mm_arenas[i]);
+        if (mm_arena->heap_first != NULL) {
+            num_checked += check_window(num_blocks - num_checked, verbose);
+            is_done = mm_arena->check_cursor == NULL;
+        }
+        arena_unlock();
+        if (!is_done) {
+            break;
+        }
+        __atomic_store_n(&mm_check_arena, (i + 1) % NUM_ARENAS, __ATOMIC_RELAXED);
+    }
+    return num_checked;
+}
+// Turns the checks of the blocks malloc and free touch on or off
+void mm_checkheap_touched(int on, int verbose) {
+    mm_check_verbose = verbose;
+    __atomic_store_n(&mm_check_touched, on != 0, __ATOMIC_RELAXED);
+}
+// Prints runtime errors in the heap's implementation and the line at which they occur
+void mm_checkheap(int verbose) {
+    if (mm_arenas[0].heap_first == NULL) {
+        printf("Error: prologue is null. Line %d", verbose);
+        return;
+    }
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        arena_lock(&mm_arenas[i]);
+        if (mm_arena->heap_first != NULL) {
+            check_arena(verbose);
+        }
+        arena_unlock();
+    }
+}
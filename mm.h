@@ -7,6 +7,17 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern void *mm_reallocarray(void *ptr, size_t nmemb, size_t size);
+extern void mm_free_aligned_sized(void *ptr, size_t alignment, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -15,11 +26,73 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void free_sized(void *ptr, size_t size);
+extern size_t malloc_batch(size_t size, size_t n, void **ptrs);
+extern void free_batch(void **ptrs, size_t n, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
+extern void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern int mm_init(void);
 
+/* Walks the heap in address order, calling visit on every block with its
+   size in bytes and whether it is allocated. Runs of small slots count as
+   one allocated block each. */
+typedef void (*mm_visit_t)(void *block, size_t size, int allocated, void *arg);
+extern void mm_heapwalk(mm_visit_t visit, void *arg);
+
+/* Statistics of the heap, kept up to date as it changes, so that reading
+   them costs no walk. Heap bytes are those taken from the system, by the
+   arenas' heaps and by huge blocks in mappings of their own; free bytes
+   are those in free blocks, including the freed blocks that wait in quick
+   bins, and all others are in use, with their headers. That includes the
+   slots of runs and the blocks held in thread caches. Free blocks are
+   counted by size class, and calls since mm_init by function: each block
+   of a batch counts as one malloc or free, and a realloc to a size of 0
+   as a free. */
+#define MM_STATS_CLASSES 64
+typedef struct {
+    size_t heap_bytes;
+    size_t in_use_bytes;
+    size_t free_bytes;
+    size_t huge_bytes;          /* also in heap_bytes and in_use_bytes */
+    size_t num_classes;         /* size classes used in free_blocks */
+    size_t free_blocks[MM_STATS_CLASSES];
+    size_t quick_blocks;
+    size_t mallocs;             /* malloc, calloc, memalign and friends */
+    size_t frees;
+    size_t reallocs;
+    size_t reallocs_in_place;   /* kept their block, or remapped it */
+    size_t reallocs_copied;     /* moved to a new block */
+    size_t sbrks;               /* calls to mem_sbrk */
+} mm_heapstats_t;
+extern void mm_heapstats(mm_heapstats_t *stats);
+
+/* Samples about one allocation per sample_bytes bytes allocated, recording
+   its call stack until it is freed, or stops sampling when sample_bytes is
+   0. mm_profile_dump writes the stacks with the bytes they have sampled,
+   and still hold, to out as a heap profile that pprof reads. It returns 0,
+   or -1 if writing failed. */
+extern void mm_profile_start(size_t sample_bytes);
+extern int mm_profile_dump(FILE *out);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+/* Checks the heap a little at a time, for heaps too large to check whole
+   as often as wanted. mm_checkheap_window checks up to num_blocks blocks,
+   each with its neighbours and its free list links, starting where the
+   last call stopped and going back to the start of the heap after its
+   end, and returns the number it checked. While mm_checkheap_touched is
+   on, malloc, free and realloc check each block they hand out, resize or
+   free, and its neighbours. Both print errors as mm_checkheap does. */
+extern size_t mm_checkheap_window(size_t num_blocks, int verbose);
+extern void mm_checkheap_touched(int on, int verbose);
@@ -0,0 +1,129 @@
+#ifndef __MM_POLICY_H_
+#define __MM_POLICY_H_
+
+/*
+ * mm_policy.h - the compile-time policies of the allocator in mm.c. Each one
+ * can be overridden with -D on the compiler's command line (the variants
+ * target of the Makefile builds one mdriver per set of them). Every policy
+ * is a constant, so the branches mm.c takes on them are folded away and each
+ * build runs only the code of its own configuration.
+ *
+ * The 16 byte alignment (ALIGNMENT in config.h) and the block layout, an 8
+ * byte header and a footer only in free blocks, are not policies: the size
+ * classes, run slots and quick bins are all laid out in 16 byte steps.
+ */
+
+/* Number of segregated free lists, one bit each in an arena's free_map. Blocks below
+ * SMALL_LIMIT bytes get one exact class per 16 byte size step, so any block in such
+ * a class fits a request of that class. Larger blocks are grouped by powers of two,
+ * and the last class also holds every block too large for the classes before it */
+#ifndef NUM_CLASSES
+#define NUM_CLASSES 64
+#endif
+#ifndef SMALL_LIMIT
+#define SMALL_LIMIT 512
+#endif
+/* Placement policies: FIRST_FIT takes the first block that fits, BEST_FIT the
+ * smallest fitting block of the lowest class able to satisfy the request. Best fit
+ * is bounded to a good fit: an exact fit, or BEST_FIT_DEPTH further blocks examined
+ * after the first fit, ends the search. Every block examined is a dependent load, a
+ * likely cache miss on a large heap, and on the driver traces blocks past the fourth
+ * no longer improve utilization */
+#define FIRST_FIT 0
+#define BEST_FIT 1
+#ifndef FIT_POLICY
+#define FIT_POLICY BEST_FIT
+#endif
+#ifndef BEST_FIT_DEPTH
+#define BEST_FIT_DEPTH 4
+#endif
+/* Orders of the free lists: LIFO_ORDER pushes a freed block at the front of its list,
+ * ADDRESS_ORDER keeps each size class in a treap keyed by block address, so that insertion
+ * stays logarithmic. A node's priority is a hash of its address, so a node needs nothing but
+ * its two child pointers, and the max size kept in large blocks lets a search find the lowest
+ * addressed fit of a class in a single descent. Searches in ADDRESS_ORDER take that fit over
+ * FIT_POLICY: they touch memory in order and favour low addresses, which leaves the top of
+ * the heap free to be trimmed */
+#define LIFO_ORDER 0
+#define ADDRESS_ORDER 1
+#ifndef LIST_ORDER
+#define LIST_ORDER LIFO_ORDER
+#endif
+/* In LIFO_ORDER, the classes of blocks of at least TREE_LIMIT bytes, a power of two no less
+ * than SMALL_LIMIT, each hold their blocks in a treap keyed by size instead of a list. A
+ * node's priority is a hash of its size, and further blocks of that size hang off it in a
+ * list, so the node can hand its place to the next block of its size. As the lowest class
+ * with a fit is searched first, a request gets the exact best fit in one descent of one
+ * class's tree. A TREE_LIMIT of 0 keeps lists in every class */
+#ifndef TREE_LIMIT
+#define TREE_LIMIT 0
+#endif
+/* The heap grows in chunks of CHUNK_PAGES pages (or to the exact request when 0); the
+ * unused end of a chunk stays at the top of the heap as the free wilderness block. The
+ * driver charges every byte of the break against utilization, so it grows exactly */
+#ifndef CHUNK_PAGES
+#ifdef DRIVER
+#define CHUNK_PAGES 0
+#else
+#define CHUNK_PAGES 16
+#endif
+#endif
+/* Freed blocks below QUICK_LIMIT bytes are not coalesced straight away: they stay marked
+ * allocated in a quick bin of their exact size, for the next request of that size. Once
+ * an arena holds more than QUICK_MAX of them, or a request finds no fit, they are all
+ * freed and coalesced in one batch. A QUICK_LIMIT of 0 coalesces every free at once */
+#ifndef QUICK_LIMIT
+#define QUICK_LIMIT 128
+#endif
+#ifndef QUICK_MAX
+#define QUICK_MAX 64
+#endif
+/* Every RELEASE_INTERVAL frees, an arena gives memory back to memlib in two ways: a free
+ * block of at least TRIM_THRESHOLD bytes at the top of the sbrk heap is cut off by moving
+ * the break down, and any other free block of at least DECOMMIT_THRESHOLD bytes that has
+ * stayed free since the previous time has the pages under its payload decommitted,
+ * leaving its header, list pointers and footer in place. Doing it on every free would
+ * fault the same pages back in over and over */
+#ifndef RELEASE_INTERVAL
+#define RELEASE_INTERVAL 4096
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+#ifndef DECOMMIT_THRESHOLD
+#define DECOMMIT_THRESHOLD (256 * 1024)
+#endif
+/* Requests of at least HUGE_THRESHOLD bytes bypass the arenas for a mapping of their own
+ * from mem_mmap, which free unmaps and realloc resizes with mem_mremap. The mapping holds
+ * one block whose payload sits D_SIZE bytes into its first page, where no run slot ever
+ * does, so a pointer there with HUGE_BIT in its header is a huge block */
+#ifndef HUGE_THRESHOLD
+#define HUGE_THRESHOLD (256 * 1024)
+#endif
+/* Zeroing for calloc and copying for realloc of at least STREAM_THRESHOLD bytes use
+ * non-temporal stores, which stream to memory instead of evicting the cache. Measured,
+ * they only pay beyond the size of the L2 cache: below it a cached memset or memcpy of
+ * data already in cache runs about twice as fast */
+#ifndef STREAM_THRESHOLD
+#define STREAM_THRESHOLD (4 * 1024 * 1024)
+#endif
+/* A class only switches to runs once it has served RUN_THRESHOLD requests from the
+ * block heap, so that a handful of small objects never pins a whole page */
+#ifndef RUN_THRESHOLD
+#define RUN_THRESHOLD 128
+#endif
+/* Built with THREAD_SAFE, threads are spread round robin over NUM_ARENAS independent
+ * arenas */
+#if defined(THREAD_SAFE) && !defined(NUM_ARENAS)
+#define NUM_ARENAS 8
+#endif
+
+_Static_assert(SMALL_LIMIT >= 64 && (SMALL_LIMIT & (SMALL_LIMIT - 1)) == 0,
+               "SMALL_LIMIT must be a power of two of at least 64");
+_Static_assert(NUM_CLASSES > SMALL_LIMIT / 16 - 2 && NUM_CLASSES <= 64,
+               "NUM_CLASSES must leave a class above the small classes and fit a 64 bit free map");
+_Static_assert(TREE_LIMIT == 0 || (TREE_LIMIT >= SMALL_LIMIT && (TREE_LIMIT & (TREE_LIMIT - 1)) == 0),
+               "TREE_LIMIT must be 0 or a power of two of at least SMALL_LIMIT");
+_Static_assert(QUICK_LIMIT % 16 == 0, "QUICK_LIMIT must be a multiple of 16");
+
+#endif /* __MM_POLICY_H_ */
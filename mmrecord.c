@@ -0,0 +1,764 @@
+/*
+ * mmrecord.c - A library that records the heap requests of a real program
+ *     as traces that mdriver can replay:
+ *
+ *         MMRECORD=<prefix> LD_PRELOAD=./libmmrecord.so <program>
+ *
+ *     It stands in front of the malloc family of whatever comes after it
+ *     (libc, or libmm.so when that is preloaded after it), and writes the
+ *     requests of each thread to <prefix>.<pid>.<n>.rep, where n counts
+ *     the threads of the process in the order they first allocate. With
+ *     MMRECORD_BIN=1 it writes the binary format of bintrace.h to
+ *     <prefix>.<pid>.<n>.bin instead. The prefix defaults to "mmrecord".
+ *
+ * Each trace is self-contained: a block gets the next id of the trace of
+ * the thread that allocates it, and every later request on the block goes
+ * into that trace, whichever thread makes it. Each thread buffers its
+ * trace's requests, and a table of live blocks, split into independently
+ * locked stripes, maps each block to its trace and id. A trace's file is
+ * written a buffer at a time, its header rewritten after each, so what
+ * has been written is always a whole trace; the rest is written when the
+ * thread exits, or at the exit of the process.
+ *
+ * calloc is recorded as an alloc, valloc and pvalloc as memaligns to the
+ * page size, and realloc to size 0 as a free. Requests made before the
+ * library is set up, of size 0 (which mdriver takes a null return from as
+ * a failure) or above INT_MAX (which do not fit the .rep format) leave
+ * their blocks unrecorded; the frees of unrecorded blocks, and of the null
+ * pointer, are left out as well, and a realloc of an unrecorded block is
+ * recorded as an alloc. A child of fork records into traces of its own.
+ */
+#define _GNU_SOURCE            /* for RTLD_NEXT */
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bintrace.h"
+
+#define BUF_OPS     4096       /* requests a trace buffers between writes */
+#define NUM_STRIPES 64         /* independently locked parts of the table */
+#define STRIPE_SLOTS 4096      /* initial slots of a stripe */
+#define BOOT_SIZE   65536      /* bytes for requests while looking up libc */
+#define REP_HDR_LEN 28         /* length of the fixed-width .rep header */
+
+/* The trace of one thread */
+typedef struct recorder {
+	pthread_mutex_t lock;  /* held while requests are added or written */
+	int fd;                /* the trace file, or -1 until first written */
+	int closed;            /* set once the trace is complete */
+	int thread;            /* n of the file name */
+	int32_t num_ids;       /* ids handed out so far */
+	int32_t num_ops;       /* requests recorded so far */
+	int32_t file_ids;      /* ids and requests already in the file */
+	int32_t file_ops;
+	int n;                 /* requests in ops */
+	bintrace_op_t *ops;    /* requests not yet written */
+	struct recorder *next; /* in the list of every trace */
+} recorder_t;
+
+/* A live block of some trace */
+typedef struct {
+	uintptr_t ptr;         /* 0 in an empty slot */
+	recorder_t *rec;
+	int32_t id;
+} entry_t;
+
+/* One part of the table of live blocks, an open addressing hash table */
+typedef struct {
+	pthread_mutex_t lock;
+	entry_t *slots;
+	size_t mask;           /* number of slots - 1 */
+	size_t count;
+} __attribute__((aligned(64))) stripe_t;
+
+/* The functions recorded, as found after this library */
+static struct {
+	void *(*malloc)(size_t);
+	void *(*calloc)(size_t, size_t);
+	void *(*realloc)(void *, size_t);
+	void (*free)(void *);
+	void *(*memalign)(size_t, size_t);
+	int (*posix_memalign)(void **, size_t, size_t);
+	void *(*aligned_alloc)(size_t, size_t);
+} real;
+
+static int ready;              /* set once real is filled in */
+static int stopped;            /* set at exit, after which nothing is recorded */
+static int binary;             /* write bintrace.h traces instead of .rep */
+static const char *prefix = "mmrecord";
+static size_t page_size;
+static pthread_key_t key;      /* a thread's recorder, to close it at exit */
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static recorder_t *recorders;  /* every trace of this process */
+static int num_threads;        /* traces started by this process */
+static stripe_t stripes[NUM_STRIPES];
+
+static __thread recorder_t *self;
+static __thread int busy;      /* set while the library itself calls out */
+
+/* Serves the requests made while dlsym looks up the real functions */
+static char boot[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+
+static void record_init(void);
+
+/*
+ * boot_alloc - Carve a block out of boot, with its size in front of it
+ */
+static void *boot_alloc(size_t size)
+{
+	size_t *p, used;
+
+	size = (size + 2 * sizeof(size_t) + 15) & ~(size_t)15;
+	used = __atomic_fetch_add(&boot_used, size, __ATOMIC_RELAXED);
+	if (size > BOOT_SIZE || used > BOOT_SIZE - size)
+		return NULL;
+	p = (size_t *)(boot + used);
+	p[1] = size - 2 * sizeof(size_t);
+	return p + 2;
+}
+
+/* is_boot - Whether p is a block of boot, which is never freed */
+static int is_boot(const void *p)
+{
+	return (const char *)p >= boot && (const char *)p < boot + BOOT_SIZE;
+}
+
+/* boot_size - The payload size of a block of boot */
+static size_t boot_size(const void *p)
+{
+	return ((const size_t *)p)[-1];
+}
+
+/*
+ * write_all - Write len bytes of buf to fd at offset, or at the end of
+ *     the file when offset is -1
+ */
+static void write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = (offset < 0) ? write(fd, p, len) : pwrite(fd, p, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		p += n;
+		len -= n;
+		if (offset >= 0)
+			offset += n;
+	}
+}
+
+/*
+ * write_header - Write a header for the requests already in rec's file,
+ *     over the one written before it
+ */
+static void write_header(recorder_t *rec)
+{
+	bintrace_hdr_t hdr;
+	char line[REP_HDR_LEN + 1];
+
+	if (binary) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+		hdr.version = BINTRACE_VERSION;
+		hdr.weight = 1;
+		hdr.num_ids = rec->file_ids;
+		hdr.num_ops = rec->file_ops;
+		write_all(rec->fd, &hdr, sizeof(hdr), 0);
+	} else {
+		/* Fixed width, so that each header exactly covers the last */
+		snprintf(line, sizeof(line), "1 %11d %11d 0\n",
+				rec->file_ids, rec->file_ops);
+		write_all(rec->fd, line, REP_HDR_LEN, 0);
+	}
+}
+
+/*
+ * put_num - Write a space and then n in decimal at p, which is much
+ *     faster than snprintf; returns the end of what it wrote
+ */
+static char *put_num(char *p, uint64_t n)
+{
+	char digits[20];
+	int i = 0;
+
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n != 0);
+	*p++ = ' ';
+	while (i > 0)
+		*p++ = digits[--i];
+	return p;
+}
+
+/*
+ * flush - Write out the requests rec has buffered, opening its file if
+ *     this is the first time; rec is locked
+ */
+static void flush(recorder_t *rec)
+{
+	char path[PATH_MAX], text[8192], *p = text;
+	bintrace_op_t *op;
+	int i;
+
+	busy++;
+	if (rec->fd < 0) {
+		snprintf(path, sizeof(path), "%s.%d.%d.%s", prefix, (int)getpid(),
+				rec->thread, binary ? "bin" : "rep");
+		rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (rec->fd < 0) {
+			/* Nothing can be recorded; keep going without it */
+			rec->closed = 1;
+			busy--;
+			return;
+		}
+		write_header(rec);
+		lseek(rec->fd, binary ? (off_t)sizeof(bintrace_hdr_t) : REP_HDR_LEN,
+				SEEK_SET);
+	}
+
+	if (binary) {
+		write_all(rec->fd, rec->ops, rec->n * sizeof(bintrace_op_t), -1);
+	} else {
+		for (i = 0; i < rec->n; i++) {
+			op = &rec->ops[i];
+			*p++ = "afrm"[op->type];  /* the letters of the BINTRACE_ types */
+			p = put_num(p, op->index);
+			if (op->type != BINTRACE_FREE)
+				p = put_num(p, op->size);
+			if (op->type == BINTRACE_MEMALIGN)
+				p = put_num(p, (uint64_t)1 << op->arg);
+			*p++ = '\n';
+			/* Every line is much shorter than 64 bytes */
+			if (p > text + sizeof(text) - 64) {
+				write_all(rec->fd, text, p - text, -1);
+				p = text;
+			}
+		}
+		write_all(rec->fd, text, p - text, -1);
+	}
+	rec->file_ids = rec->num_ids;
+	rec->file_ops = rec->num_ops;
+	rec->n = 0;
+	write_header(rec);
+	busy--;
+}
+
+/*
+ * add_op - Add a request to rec's trace, unless it is complete; returns
+ *     the request's block id, which a new block is given here when id is
+ *     -1, or -1 if nothing was added
+ */
+static int32_t add_op(recorder_t *rec, int type, int arg, int32_t id,
+		size_t size)
+{
+	bintrace_op_t *op;
+
+	pthread_mutex_lock(&rec->lock);
+	if (rec->closed) {
+		pthread_mutex_unlock(&rec->lock);
+		return -1;
+	}
+	if (id < 0)
+		id = rec->num_ids++;
+	op = &rec->ops[rec->n++];
+	op->type = type;
+	op->arg = arg;
+	op->index = id;
+	op->size = size;
+	rec->num_ops++;
+	if (rec->n == BUF_OPS)
+		flush(rec);
+	pthread_mutex_unlock(&rec->lock);
+	return id;
+}
+
+/*
+ * close_recorder - Write out the rest of rec's trace, which then takes no
+ *     more requests; a trace with no blocks leaves no file
+ */
+static void close_recorder(recorder_t *rec)
+{
+	pthread_mutex_lock(&rec->lock);
+	if (!rec->closed) {
+		if (rec->num_ids > 0)
+			flush(rec);
+		if (rec->fd >= 0)
+			close(rec->fd);
+		rec->closed = 1;
+		munmap(rec->ops, BUF_OPS * sizeof(bintrace_op_t));
+		rec->ops = NULL;
+	}
+	pthread_mutex_unlock(&rec->lock);
+}
+
+/* thread_exit - Close a thread's trace as the thread exits */
+static void thread_exit(void *rec)
+{
+	close_recorder(rec);
+}
+
+/*
+ * get_recorder - The calling thread's trace, which is started by its
+ *     first request; NULL if nothing it asks for is to be recorded
+ */
+static recorder_t *get_recorder(void)
+{
+	recorder_t *rec;
+
+	if (self != NULL)
+		return self->closed ? NULL : self;
+	if (__atomic_load_n(&stopped, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	busy++;
+	rec = mmap(NULL, sizeof(recorder_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rec == MAP_FAILED) {
+		busy--;
+		return NULL;
+	}
+	rec->ops = mmap(NULL, BUF_OPS * sizeof(bintrace_op_t),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rec->ops == MAP_FAILED) {
+		munmap(rec, sizeof(recorder_t));
+		busy--;
+		return NULL;
+	}
+	pthread_mutex_init(&rec->lock, NULL);
+	rec->fd = -1;
+
+	pthread_mutex_lock(&list_lock);
+	rec->thread = num_threads++;
+	rec->next = recorders;
+	recorders = rec;
+	pthread_mutex_unlock(&list_lock);
+
+	self = rec;
+	pthread_setspecific(key, rec);
+	busy--;
+	return rec;
+}
+
+/* hash - Mixes the bits of a block pointer into all of a word */
+static inline uintptr_t hash(uintptr_t ptr)
+{
+	return ptr * 0x9e3779b97f4a7c15ULL;
+}
+
+/* get_stripe - The stripe of the table that holds ptr */
+static inline stripe_t *get_stripe(uintptr_t ptr)
+{
+	return &stripes[hash(ptr) >> 58];
+}
+
+/* home - The slot where the probe for ptr starts in s */
+static inline size_t home(const stripe_t *s, uintptr_t ptr)
+{
+	return (hash(ptr) >> 20) & s->mask;
+}
+
+/*
+ * stripe_resize - Move the entries of s into a table of num_slots slots;
+ *     returns 0 if that table could not be mapped
+ */
+static int stripe_resize(stripe_t *s, size_t num_slots)
+{
+	entry_t *old = s->slots, *slots;
+	size_t old_slots = (old == NULL) ? 0 : s->mask + 1;
+	size_t i, j;
+
+	slots = mmap(NULL, num_slots * sizeof(entry_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED)
+		return 0;
+	s->slots = slots;
+	s->mask = num_slots - 1;
+	for (i = 0; i < old_slots; i++) {
+		if (old[i].ptr == 0)
+			continue;
+		for (j = home(s, old[i].ptr); slots[j].ptr != 0; j = (j + 1) & s->mask)
+			;
+		slots[j] = old[i];
+	}
+	if (old != NULL)
+		munmap(old, old_slots * sizeof(entry_t));
+	return 1;
+}
+
+/*
+ * table_put - Record that ptr is block id of rec's trace, replacing
+ *     whatever ptr was before
+ */
+static void table_put(void *ptr, recorder_t *rec, int32_t id)
+{
+	uintptr_t key_ptr = (uintptr_t)ptr;
+	stripe_t *s = get_stripe(key_ptr);
+	size_t i;
+
+	pthread_mutex_lock(&s->lock);
+	if ((s->slots == NULL || 2 * (s->count + 1) > s->mask + 1) &&
+			!stripe_resize(s, (s->slots == NULL) ? STRIPE_SLOTS : 2 * (s->mask + 1))) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	for (i = home(s, key_ptr); s->slots[i].ptr != 0; i = (i + 1) & s->mask)
+		if (s->slots[i].ptr == key_ptr)
+			break;
+	if (s->slots[i].ptr == 0)
+		s->count++;
+	s->slots[i].ptr = key_ptr;
+	s->slots[i].rec = rec;
+	s->slots[i].id = id;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * table_take - Remove ptr from the table into *entry; returns 0 if it
+ *     is not a recorded block
+ */
+static int table_take(void *ptr, entry_t *entry)
+{
+	uintptr_t key_ptr = (uintptr_t)ptr;
+	stripe_t *s = get_stripe(key_ptr);
+	size_t i, j, k;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->slots == NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+	for (i = home(s, key_ptr); s->slots[i].ptr != key_ptr; i = (i + 1) & s->mask)
+		if (s->slots[i].ptr == 0) {
+			pthread_mutex_unlock(&s->lock);
+			return 0;
+		}
+	*entry = s->slots[i];
+	s->count--;
+
+	/* Move back each later entry of the run that may no longer be found */
+	for (j = i;;) {
+		s->slots[i].ptr = 0;
+		do {
+			j = (j + 1) & s->mask;
+			if (s->slots[j].ptr == 0) {
+				pthread_mutex_unlock(&s->lock);
+				return 1;
+			}
+			k = home(s, s->slots[j].ptr);
+		} while ((i <= j) ? (i < k && k <= j) : (i < k || k <= j));
+		s->slots[i] = s->slots[j];
+		i = j;
+	}
+}
+
+/*
+ * recording - Whether the calling thread's requests are to be recorded
+ *     now; sets the library up first if need be
+ */
+static inline int recording(void)
+{
+	if (__builtin_expect(!ready, 0))
+		record_init();
+	return ready && !busy && !__atomic_load_n(&stopped, __ATOMIC_RELAXED);
+}
+
+/*
+ * record_alloc - Give the new block ptr of size bytes, aligned to
+ *     1 << align_log, the next id of the calling thread's trace
+ */
+static void record_alloc(void *ptr, size_t size, int align_log)
+{
+	recorder_t *rec;
+	int32_t id;
+
+	if (ptr == NULL || size == 0 || size > INT_MAX ||
+			(rec = get_recorder()) == NULL)
+		return;
+	id = add_op(rec, align_log ? BINTRACE_MEMALIGN : BINTRACE_ALLOC,
+			align_log, -1, size);
+	if (id >= 0)
+		table_put(ptr, rec, id);
+}
+
+/*
+ * record_memalign - record_alloc for a block aligned to align bytes,
+ *     rounded up to a power of two as memalign does
+ */
+static void record_memalign(void *ptr, size_t size, size_t align)
+{
+	record_alloc(ptr, size, (align <= 1) ? 0 : 64 - __builtin_clzl(align - 1));
+}
+
+void *malloc(size_t size)
+{
+	void *ptr;
+
+	if (!recording())
+		return ready ? real.malloc(size) : boot_alloc(size);
+	ptr = real.malloc(size);
+	record_alloc(ptr, size, 0);
+	return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (!recording()) {
+		if (ready)
+			return real.calloc(nmemb, size);
+		if (size != 0 && nmemb > SIZE_MAX / size)
+			return NULL;
+		return boot_alloc(nmemb * size);  /* boot is still all zero */
+	}
+	ptr = real.calloc(nmemb, size);
+	if (ptr != NULL)
+		record_alloc(ptr, nmemb * size, 0);
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	entry_t entry;
+
+	if (ptr == NULL || is_boot(ptr))
+		return;
+	if (!ready && (record_init(), !ready))
+		return;
+	/* The entry goes whether or not the free is recorded, so that it can
+	   never be taken for a later block at the same address */
+	if (table_take(ptr, &entry) && recording())
+		add_op(entry.rec, BINTRACE_FREE, 0, entry.id, 0);
+	real.free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	entry_t entry;
+	int tracked;
+	void *new_ptr;
+
+	if (ptr == NULL)
+		return malloc(size);
+	if (is_boot(ptr)) {
+		/* Move it out of boot; the old block is simply left there */
+		if ((new_ptr = malloc(size)) != NULL)
+			memcpy(new_ptr, ptr, size < boot_size(ptr) ? size : boot_size(ptr));
+		return new_ptr;
+	}
+	if (!ready && (record_init(), !ready))
+		return NULL;
+
+	tracked = table_take(ptr, &entry);
+	new_ptr = real.realloc(ptr, size);
+	if (new_ptr == NULL && size != 0) {
+		/* ptr is still allocated */
+		if (tracked)
+			table_put(ptr, entry.rec, entry.id);
+		return NULL;
+	}
+	if (!recording())
+		return new_ptr;
+	if (!tracked) {
+		record_alloc(new_ptr, size, 0);
+	} else if (size == 0 || size > INT_MAX) {
+		/* What is left at new_ptr, if anything, goes unrecorded */
+		add_op(entry.rec, BINTRACE_FREE, 0, entry.id, 0);
+	} else if (add_op(entry.rec, BINTRACE_REALLOC, 0, entry.id, size) >= 0) {
+		table_put(new_ptr, entry.rec, entry.id);
+	}
+	return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, nmemb * size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!recording())
+		return ready ? real.memalign(alignment, size) : NULL;
+	ptr = real.memalign(alignment, size);
+	record_memalign(ptr, size, alignment);
+	return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	int err;
+
+	if (!recording())
+		return ready ? real.posix_memalign(memptr, alignment, size) : ENOMEM;
+	if ((err = real.posix_memalign(memptr, alignment, size)) == 0)
+		record_memalign(*memptr, size, alignment);
+	return err;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!recording())
+		return ready ? real.aligned_alloc(alignment, size) : NULL;
+	ptr = real.aligned_alloc(alignment, size);
+	record_memalign(ptr, size, alignment);
+	return ptr;
+}
+
+void *valloc(size_t size)
+{
+	if (!ready)
+		record_init();
+	return memalign(page_size, size);
+}
+
+void *pvalloc(size_t size)
+{
+	if (!ready)
+		record_init();
+	if (size > SIZE_MAX - page_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return memalign(page_size, size == 0 ? page_size :
+			(size + page_size - 1) & ~(page_size - 1));
+}
+
+/*
+ * fork_prepare, fork_parent, fork_child - Hold the table across fork, so
+ *     that the child gets it whole; the child then drops the parent's
+ *     traces and blocks and starts over with traces of its own
+ */
+static void fork_prepare(void)
+{
+	int i;
+
+	pthread_mutex_lock(&list_lock);
+	for (i = 0; i < NUM_STRIPES; i++)
+		pthread_mutex_lock(&stripes[i].lock);
+}
+
+static void fork_parent(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_STRIPES; i++)
+		pthread_mutex_unlock(&stripes[i].lock);
+	pthread_mutex_unlock(&list_lock);
+}
+
+static void fork_child(void)
+{
+	recorder_t *rec, *next;
+	int i;
+
+	for (rec = recorders; rec != NULL; rec = next) {
+		next = rec->next;
+		if (rec->fd >= 0)
+			close(rec->fd);
+		if (rec->ops != NULL)
+			munmap(rec->ops, BUF_OPS * sizeof(bintrace_op_t));
+		munmap(rec, sizeof(recorder_t));
+	}
+	recorders = NULL;
+	num_threads = 0;
+	self = NULL;
+	pthread_setspecific(key, NULL);
+	for (i = 0; i < NUM_STRIPES; i++) {
+		if (stripes[i].slots != NULL)
+			munmap(stripes[i].slots, (stripes[i].mask + 1) * sizeof(entry_t));
+		stripes[i].slots = NULL;
+		stripes[i].count = 0;
+		pthread_mutex_init(&stripes[i].lock, NULL);
+	}
+	pthread_mutex_init(&list_lock, NULL);
+}
+
+/*
+ * record_init - Find the functions being recorded and read the settings.
+ *     It runs at the first request, which may come before constructors.
+ */
+static void record_init(void)
+{
+	static int started;
+	const char *env;
+	int i;
+
+	if (__atomic_exchange_n(&started, 1, __ATOMIC_ACQ_REL))
+		return;  /* requests meanwhile, from dlsym itself, go to boot */
+
+	real.malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	real.calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+	real.realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+	real.free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+	real.memalign = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "memalign");
+	real.posix_memalign =
+		(int (*)(void **, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+	real.aligned_alloc =
+		(void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "aligned_alloc");
+	if (real.malloc == NULL || real.calloc == NULL || real.realloc == NULL ||
+			real.free == NULL || real.memalign == NULL ||
+			real.posix_memalign == NULL || real.aligned_alloc == NULL) {
+		static const char msg[] = "mmrecord: the malloc functions were not found\n";
+		write_all(STDERR_FILENO, msg, sizeof(msg) - 1, -1);
+		abort();
+	}
+
+	if ((env = getenv("MMRECORD")) != NULL && env[0] != '\0')
+		prefix = env;
+	if ((env = getenv("MMRECORD_BIN")) != NULL)
+		binary = atoi(env);
+	page_size = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < NUM_STRIPES; i++)
+		pthread_mutex_init(&stripes[i].lock, NULL);
+	pthread_key_create(&key, thread_exit);
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+	__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+}
+
+/* record_start - Sets the library up, if no request has yet */
+__attribute__((constructor))
+static void record_start(void)
+{
+	if (!ready)
+		record_init();
+}
+
+/*
+ * record_stop - Write out every trace at the exit of the process; the
+ *     requests made after that are not recorded
+ */
+__attribute__((destructor))
+static void record_stop(void)
+{
+	recorder_t *rec;
+
+	__atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&list_lock);
+	for (rec = recorders; rec != NULL; rec = rec->next)
+		close_recorder(rec);
+	pthread_mutex_unlock(&list_lock);
+}
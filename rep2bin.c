@@ -0,0 +1,108 @@
+/*
+ * rep2bin.c - Converts a text .rep trace into the binary trace format
+ *     of bintrace.h, which mdriver loads with mmap instead of parsing.
+ *
+ * usage: rep2bin <trace.rep> <trace.bin>
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bintrace.h"
+
+#define MAXLINE 1024
+
+/* die - Print an error message about filename and exit */
+static void die(const char *filename, const char *msg)
+{
+	fprintf(stderr, "rep2bin: %s: %s\n", filename, msg);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	bintrace_hdr_t hdr;
+	bintrace_op_t op;
+	char type[MAXLINE];
+	int index, max_index = -1;
+	unsigned long size, align, count;
+	int n;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: rep2bin <trace.rep> <trace.bin>\n");
+		exit(1);
+	}
+	if ((in = fopen(argv[1], "r")) == NULL)
+		die(argv[1], strerror(errno));
+
+	/* The header is the same four numbers as in the .rep file */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = BINTRACE_VERSION;
+	if (fscanf(in, "%d %d %d %d", &hdr.weight, &hdr.num_ids,
+				&hdr.num_ops, &hdr.ignore_ranges) != 4)
+		die(argv[1], "bad trace header");
+
+	if ((out = fopen(argv[2], "w")) == NULL)
+		die(argv[2], strerror(errno));
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		die(argv[2], strerror(errno));
+
+	/* Then one record per request line */
+	for (n = 0; n < hdr.num_ops && fscanf(in, "%s", type) == 1; n++) {
+		memset(&op, 0, sizeof(op));
+		switch (type[0]) {
+			case 'a':
+			case 'r':
+				if (fscanf(in, "%d %lu", &index, &size) != 2 || size > INT_MAX)
+					die(argv[1], "bad alloc or realloc request");
+				op.type = (type[0] == 'a') ? BINTRACE_ALLOC : BINTRACE_REALLOC;
+				op.size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'f':
+				if (fscanf(in, "%d", &index) != 1)
+					die(argv[1], "bad free request");
+				op.type = BINTRACE_FREE;
+				break;
+			case 'm':
+				if (fscanf(in, "%d %lu %lu", &index, &size, &align) != 3 ||
+						size > INT_MAX || align == 0 || (align & (align - 1)) != 0)
+					die(argv[1], "bad memalign request");
+				op.type = BINTRACE_MEMALIGN;
+				op.arg = __builtin_ctzl(align);
+				op.size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'b':
+			case 'B':
+				if (fscanf(in, "%d %lu %lu", &index, &count, &size) != 3 ||
+						count == 0 || count > UINT16_MAX || size > INT_MAX)
+					die(argv[1], "bad batch request");
+				op.type = (type[0] == 'b') ? BINTRACE_BATCH_ALLOC : BINTRACE_BATCH_FREE;
+				op.arg = count;
+				op.size = size;
+				if (type[0] == 'b')
+					max_index = (index + (int)count - 1 > max_index) ?
+						index + (int)count - 1 : max_index;
+				break;
+			default:
+				die(argv[1], "bogus request type");
+		}
+		op.index = index;
+		if (fwrite(&op, sizeof(op), 1, out) != 1)
+			die(argv[2], strerror(errno));
+	}
+	if (n != hdr.num_ops)
+		die(argv[1], "fewer requests than the header says");
+	if (max_index != hdr.num_ids - 1)
+		die(argv[1], "block ids do not match the header");
+
+	fclose(in);
+	if (fclose(out) != 0)
+		die(argv[2], strerror(errno));
+	return 0;
+}